@@ -79,16 +79,21 @@ void headerProcessor(std::vector<string> inputs, bool ok, std::string file) {
     }
 }
 
-// Takes in the file and processes the data from the istream
-void processFile(std::istream& in) {
-    std::string input;
-    while (std::getline(in, input)) {        
-        // Send chunk size to client.
-        std::cout << std::hex << input.size()+1 << "\r\n";
-        // Write the actual data for the line.
-        std::cout << input << "\r\n";
+// Copies data from the istream to std::cout as HTTP chunks of up to
+// blockSize bytes each. Bytes are sent as-is so binary files work too.
+void sendChunks(std::istream& in, size_t blockSize = 16384) {
+    std::vector<char> block(blockSize);
+    while (in.read(block.data(), block.size()) || (in.gcount() > 0)) {
+        // Send chunk size to client followed by the data.
+        std::cout << std::hex << in.gcount() << "\r\n";
+        std::cout.write(block.data(), in.gcount());
         std::cout << "\r\n";
     }
+}
+
+// Takes in the file and processes the data from the istream
+void processFile(std::istream& in) {
+    sendChunks(in);
     std::cout << "0\r\n";  // Last line
 }
 
@@ -116,14 +121,10 @@ void parent(int pipefd[]) {  //  std::vector<char*> data) {
     close(pipefd[WRITE]);  // WRITE is constant 1 (one)
     __gnu_cxx::stdio_filebuf<char> fb(pipefd[READ], std::ios::in, 1);
     std::istream is(&fb);
-    std::string line;
-    while (getline(is, line)) {
-        std::cout << std::hex << line.size()+1 << "\r\n";
-        std::cout << line << "\r\n\r\n";
-    }
-    std::string exit = "Exit code: 0\r\n\r\n";
-    std::cout << std::hex << exit.size() << "\r\n\r\n";
-    std::cout << exit;
+    sendChunks(is);
+    std::string exit = "Exit code: 0\r\n";
+    std::cout << std::hex << exit.size() << "\r\n";
+    std::cout << exit << "\r\n";
     close(pipefd[READ]);
 }
 
@@ -16,6 +16,7 @@
 #include <iostream>
 #include <cstdlib>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <fstream>
 #include <iterator>
@@ -23,7 +24,23 @@
 #include <algorithm>
 #include <thread>
 #include <mutex>  
+#include <atomic>
+#include <array>
+#include <memory>
+#include <optional>
+#include <charconv>
 #include <sstream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // Using namespace to streamline working with Boost socket.
 
@@ -37,121 +54,565 @@ using FileList = std::vector<std::string>;
 using URLOutput = std::vector<std::string>;
 using ThreadList = std::vector<std::thread>;
 
-/** Return a sorted list of words from a file to use as an dictionary.
+/**
+ * An immutable set of (lower case) words used as a dictionary.
  *
- * \param[in] filePath Path to the dictionary file to be used.
+ * The words are stored back-to-back in a single string (the arena) and
+ * indexed by an open-addressing hash table with linear probing that is
+ * at most half full.  Each slot holds the hash, offset, and length of a
+ * word, so a lookup usually touches one slot and compares one word.
+ * Once built, the set is only read and can be shared by any number of
+ * threads without locking.
  *
- * \return A vector containing a sorted list of words loaded from the
- * given file.
+ * The table and arena can be saved to an index file (see save) that
+ * is later mapped into memory and used in place, so that no parsing or
+ * allocation is needed at startup.  The index file has a header (see
+ * IndexHeader) followed by the table and then the arena.
  */
-StrVec loadDictionary(const std::string& filePath = "english.txt") {
-    std::ifstream englishWords(filePath);
-    std::istream_iterator<std::string> in(englishWords), eof;
-    StrVec dictionary(in, eof);
-    std::sort(dictionary.begin(), dictionary.end());
-    return dictionary;
+class Dictionary {
+public:
+    /**
+     * Load the dictionary for a word list.
+     *
+     * If there is a valid index file (the word list's path with
+     * ".idx" appended) that is not older than the word list, it is
+     * mapped into memory.  Otherwise the word list is read.
+     *
+     * \param[in] filePath Path to the file with whitespace separated
+     * words.  Words are converted to lower case.
+     */
+    explicit Dictionary(const std::string& filePath) {
+        if (!map(filePath + ".idx", filePath)) {
+            std::ifstream is(filePath);
+            build(is);
+        }
+    }
+
+    ~Dictionary() {
+        if (mapped != MAP_FAILED) {
+            munmap(mapped, mappedSize);
+        }
+    }
+
+    // The table refers to the arena (or mapping) of this object.
+    Dictionary(const Dictionary&) = delete;
+    Dictionary& operator=(const Dictionary&) = delete;
+
+    /**
+     * Check if the dictionary has a given word, ignoring case.
+     *
+     * \param[in] word The word to be checked.
+     *
+     * \return This method returns true if the word is in the dictionary.
+     */
+    bool contains(std::string_view word) const {
+        return !word.empty() && (slots[find(word, hash(word))].length != 0);
+    }
+
+    /** Returns the number of distinct words in the dictionary. */
+    size_t size() const {
+        return count;
+    }
+
+    /** Returns true if the dictionary was mapped from an index file. */
+    bool isMapped() const {
+        return mapped != MAP_FAILED;
+    }
+
+    /**
+     * Save the dictionary as an index file.  The file is written under
+     * a temporary name and then renamed, so that a reader never maps a
+     * partially written file.
+     *
+     * \param[in] indexPath The path to the index file to be created.
+     *
+     * \return This method returns true if the file was written.
+     */
+    bool save(const std::string& indexPath) const {
+        IndexHeader header;
+        header.count     = count;
+        header.slotCount = mask + 1;
+        header.arenaSize = arenaSize;
+        const std::string table(reinterpret_cast<const char*>(slots),
+                                (mask + 1) * sizeof(Slot));
+        header.checksum = checksum(table.data(), table.size(),
+                                   checksum(words, arenaSize));
+        const std::string tmpPath = indexPath + ".tmp";
+        std::ofstream os(tmpPath, std::ios::binary);
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        os.write(table.data(), table.size());
+        os.write(words, arenaSize);
+        os.close();
+        return os.good() && (std::rename(tmpPath.c_str(),
+                                         indexPath.c_str()) == 0);
+    }
+
+private:
+    // An entry in the hash table.  Empty slots have a length of 0.
+    struct Slot {
+        uint32_t hash = 0, offset = 0, length = 0;
+    };
+
+    // The start of an index file.  The values are in the byte order
+    // of the machine that wrote the file (checked via byteOrder).
+    struct IndexHeader {
+        char magic[8] = {'H', 'W', '6', 'D', 'I', 'C', 'T', '\0'};
+        uint32_t version   = 2;
+        uint32_t byteOrder = 0x01020304;
+        uint64_t count = 0, slotCount = 0, arenaSize = 0;
+        // Checksum of the arena followed by the table.
+        uint64_t checksum = 0;
+    };
+
+    // Read the words from a stream and build the table.
+    void build(std::istream& is) {
+        std::vector<Slot> words;
+        std::string word;
+        while (is >> word) {
+            const uint32_t offset = arena.size();
+            for (const char c : word) {
+                arena.push_back(toLower(c));
+            }
+            words.push_back({hash(word), offset,
+                             static_cast<uint32_t>(word.size())});
+        }
+        size_t capacity = 16;
+        while (capacity < 2 * words.size()) {
+            capacity *= 2;
+        }
+        table.resize(capacity);
+        mask      = capacity - 1;
+        slots     = table.data();
+        this->words = arena.data();
+        arenaSize = arena.size();
+        for (const Slot& entry : words) {
+            const std::string_view text(arena.data() + entry.offset,
+                                        entry.length);
+            Slot& slot = table[find(text, entry.hash)];
+            if (slot.length == 0) {
+                slot = entry;
+                count++;
+            }
+        }
+    }
+
+    // Map an index file (if it is valid and up to date) and use it.
+    bool map(const std::string& indexPath, const std::string& filePath) {
+        struct stat index, list;
+        if ((stat(indexPath.c_str(), &index) != 0) ||
+            ((stat(filePath.c_str(), &list) == 0) &&
+             ((list.st_mtim.tv_sec > index.st_mtim.tv_sec) ||
+              ((list.st_mtim.tv_sec == index.st_mtim.tv_sec) &&
+               (list.st_mtim.tv_nsec > index.st_mtim.tv_nsec)))) ||
+            (static_cast<size_t>(index.st_size) < sizeof(IndexHeader))) {
+            return false;  // No index or it is stale.
+        }
+        const int fd = open(indexPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        void* const data = mmap(nullptr, index.st_size, PROT_READ,
+                                MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        const IndexHeader& header = *static_cast<const IndexHeader*>(data);
+        const IndexHeader expected;
+        const char* const table = static_cast<const char*>(data) +
+            sizeof(IndexHeader);
+        const uint64_t tableSize = header.slotCount * sizeof(Slot);
+        if ((std::memcmp(header.magic, expected.magic, 8) != 0) ||
+            (header.version != expected.version) ||
+            (header.byteOrder != expected.byteOrder) ||
+            (header.slotCount == 0) ||
+            ((header.slotCount & (header.slotCount - 1)) != 0) ||
+            (sizeof(IndexHeader) + tableSize + header.arenaSize !=
+             static_cast<uint64_t>(index.st_size)) ||
+            (checksum(table, tableSize, checksum(table + tableSize,
+                                                 header.arenaSize)) !=
+             header.checksum)) {
+            munmap(data, index.st_size);
+            return false;  // Not an index file or it is damaged.
+        }
+        mapped     = data;
+        mappedSize = index.st_size;
+        slots      = reinterpret_cast<const Slot*>(table);
+        words      = table + tableSize;
+        mask       = header.slotCount - 1;
+        arenaSize  = header.arenaSize;
+        count      = header.count;
+        return true;
+    }
+
+    // Lower case conversion for ASCII (as in the "C" locale).
+    static char toLower(char c) {
+        return ((c >= 'A') && (c <= 'Z')) ? (c - 'A' + 'a') : c;
+    }
+
+    // Converts the ASCII upper case letters in 8 bytes to lower case
+    // (all 8 at once, i.e., SIMD within a register).
+    static uint64_t toLower8(uint64_t w) {
+        const uint64_t ones = 0x0101010101010101ull;
+        const uint64_t low7 = w & (0x7f * ones);
+        // The high bit of each byte is set for 'A' <= byte <= 'Z'.
+        const uint64_t upper = (low7 + (0x80 - 'A') * ones) &
+            ~(low7 + (0x80 - 'Z' - 1) * ones) & ~w & (0x80 * ones);
+        return w | (upper >> 2);
+    }
+
+    // Load up to 8 bytes of a word (zero padded) as an integer without
+    // reading past the end of the word.  Shorter words are assembled
+    // from overlapping loads (the overlapping bytes are the same).
+    static uint64_t load8(const char* data, size_t size) {
+        uint64_t w = 0;
+        if (size >= 8) {
+            std::memcpy(&w, data, 8);
+        } else if (size >= 4) {
+            uint32_t first, last;
+            std::memcpy(&first, data, 4);
+            std::memcpy(&last, data + size - 4, 4);
+            w = first | (uint64_t(last) << ((size - 4) * 8));
+        } else if (size > 0) {
+            const unsigned char* const u =
+                reinterpret_cast<const unsigned char*>(data);
+            w = u[0] | (uint64_t(u[size / 2]) << (size / 2 * 8)) |
+                (uint64_t(u[size - 1]) << ((size - 1) * 8));
+        }
+        return w;
+    }
+
+    // Hash of the lower case form of a word, computed 8 bytes at a time.
+    static uint32_t hash(std::string_view word) {
+        uint64_t h = word.size() * 0x9e3779b97f4a7c15ull;
+        for (size_t i = 0; (i < word.size()); i += 8) {
+            h = (h ^ toLower8(load8(word.data() + i, word.size() - i))) *
+                0xff51afd7ed558ccdull;
+            h ^= h >> 32;
+        }
+        h *= 0xc4ceb9fe1a85ec53ull;
+        return static_cast<uint32_t>(h ^ (h >> 29));
+    }
+
+    // Check if a word matches (ignoring case) the lower case word of the
+    // same size in the arena.
+    bool equals(std::string_view word, const char* lower) const {
+        for (size_t i = 0; (i < word.size()); i += 8) {
+            const size_t left = word.size() - i;
+            if (toLower8(load8(word.data() + i, left)) !=
+                load8(lower + i, left)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // FNV-1a style checksum of a block of data (8 bytes at a time so
+    // that checking an index file takes well under a millisecond).
+    static uint64_t checksum(const char* data, size_t size,
+                             uint64_t h = 14695981039346656037ull) {
+        size_t i = 0;
+        for (uint64_t block; (i + 8 <= size); i += 8) {
+            std::memcpy(&block, data + i, 8);
+            h = (h ^ block) * 1099511628211ull;
+        }
+        for (; (i < size); i++) {
+            h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    // Return the index of the slot holding the word or of the empty
+    // slot where it would be inserted.
+    size_t find(std::string_view word, uint32_t h) const {
+        for (size_t i = h & mask; ; i = (i + 1) & mask) {
+            const Slot& slot = slots[i];
+            if ((slot.length == 0) ||
+                ((slot.hash == h) && (slot.length == word.size()) &&
+                 equals(word, words + slot.offset))) {
+                return i;
+            }
+        }
+    }
+
+    // The storage for a dictionary built from a word list.
+    std::string arena;
+    std::vector<Slot> table;
+    // The memory mapped index file (if any).
+    void* mapped = MAP_FAILED;
+    size_t mappedSize = 0;
+    // The table and arena in use (from either of the above).
+    const Slot* slots = nullptr;
+    const char* words = nullptr;
+    size_t mask = 0, count = 0, arenaSize = 0;
+};
+
+/** Load the words from a file to use as a dictionary.
+ *
+ * \param[in] filePath Path to the dictionary file to be used.  A
+ * precompiled index (see compileDictionary) is used if there is one.
+ *
+ * \return The dictionary with the words loaded from the given file.
+ */
+Dictionary loadDictionary(const std::string& filePath = "english.txt") {
+    return Dictionary(filePath);
+}
+
+/** Compile a word list into an index file that is mapped (instead of
+ * parsing the word list) by loadDictionary.
+ *
+ * \param[in] filePath Path to the word list.
+ *
+ * \param[in] indexPath Path to the index file to be created.  It must
+ * be the word list's path with ".idx" appended to be used by
+ * loadDictionary.
+ *
+ * \return This method returns true if the index file was written.
+ */
+bool compileDictionary(const std::string& filePath,
+                       const std::string& indexPath) {
+    std::ifstream is(filePath);
+    if (!is) {
+        return false;
+    }
+    const Dictionary dictionary(filePath);
+    return dictionary.save(indexPath);
 }
 
 /**
  * Check if a given word is a valid English word.
  *
- * \param[in] dictionary A sorted dictionary of words to be used for
- * checking.  NOTE: This list *must* be sorted in order to use it with
- * binary_search.
+ * \param[in] dictionary The dictionary of words to be used for
+ * checking.
  *
- * \param[in] word The word to be checked.
+ * \param[in] word The word to be checked (in any case).
  *
  * \return This method returns true if the word was found in the
  * dictionary.  Otherwise it returns false.
  */
-bool isValidWord(const StrVec& dictionary, std::string word) {
-    // Convert the word to lower case to check against the dictionary.
-    std::transform(word.begin(), word.end(), word.begin(), tolower);
-    // Use binary search to find word in the dictionary.
-    return std::binary_search(dictionary.begin(), dictionary.end(), word);
+bool isValidWord(const Dictionary& dictionary, std::string_view word) {
+    return dictionary.contains(word);
 }
 
+/** The number of words, and of those the number of English words, in
+ * some text.
+ */
+struct WordCounts {
+    uint64_t words = 0, english = 0;
+};
+
+/** The ways in which WordCounter can classify bytes. */
+enum class Simd { Scalar, Sse2, Avx2 };
+
 /**
- * Helper method to change punctuation in a given line to blank
- * spaces.
- *
- * This method replaces puctuations and special characters in a line
- * with blank spaces. For example, "<div class='line'>and,</div>" is
- * transformed to " div class line and div".
+ * Counts the words (and English words) in text in a single pass.
  *
- * \param[in] line The line of data in which punctuation are to be
- * removed.
- *
- * \return A string in which punctuation and special characters have
- * been replaced with blank spaces to ease extracting words.
+ * Words are runs of characters other than white space and punctuation
+ * (as given by isspace and ispunct in the "C" locale).  The text is
+ * classified 64 bytes at a time into a bit mask of word characters
+ * using SSE2 or AVX2 (if available) range compares.  The starts and
+ * ends of words are then found with bit operations and each word is
+ * looked up in the dictionary in place.  Text can be added in blocks
+ * of any size; only a word that spans blocks is copied.
  */
-std::string changePunct(std::string line) {
-    std::replace_if(line.begin(), line.end(), ispunct, ' ');
-    return line;
-}
+class WordCounter {
+public:
+    /**
+     * Create a counter.
+     *
+     * \param[in] dictionary The dictionary with the English words.
+     *
+     * \param[in] simd The instructions to be used to classify bytes.
+     * By default the best one supported by the CPU is used.
+     */
+    explicit WordCounter(const Dictionary& dictionary,
+                         Simd simd = bestSimd())
+        : dictionary(dictionary), classify(classifier(simd)) {
+    }
 
-// Counts the total number of words in a string, regardless of if they are
-// actually valid words in a language or not
-int countWords(std::string s) {
-    int count = 0;
-    std::stringstream ss(s);
-    std::string word;
-    while (ss >> word) {
-        count++;
+    /** Count the words in the next block of text. */
+    void add(const char* data, size_t size) {
+        size_t start = 0;  // Start of the current word in this block.
+        for (size_t base = 0; (base < size); base += 64) {
+            const size_t count = std::min<size_t>(64, size - base);
+            uint64_t mask;
+            if (count == 64) {
+                mask = classify(data + base);
+            } else {
+                // Pad the last part of the block with spaces.
+                char tail[64];
+                std::memset(tail, ' ', sizeof(tail));
+                std::memcpy(tail, data + base, count);
+                mask = classify(tail);
+            }
+            // Bits for the first byte of each word and the first byte
+            // after each word (ignoring any padding).
+            const uint64_t before = (mask << 1) | (inWord ? 1 : 0);
+            const uint64_t starts = mask & ~before;
+            uint64_t edges = (starts | (~mask & before)) &
+                ((count == 64) ? ~uint64_t(0) : ((uint64_t(1) << count) - 1));
+            counts.words += __builtin_popcountll(starts);
+            for (; (edges != 0); edges &= edges - 1) {
+                const size_t pos = base + __builtin_ctzll(edges);
+                if (!((starts >> (pos - base)) & 1)) {
+                    endWord(data + start, pos - start);
+                }
+                start = pos;
+            }
+            inWord = (mask >> (count - 1)) & 1;
+        }
+        if (inWord) {
+            // The word continues in the next block.
+            partial.append(data + start, size - start);
+        }
     }
-    return count;
-}
 
-// Counts the number of english words by comparing each word to the
-// dictionary file of all words
-int countEnglish(std::string s, const StrVec& dictionary) {
-    int count = 0;
-    std::stringstream ss(s);
-    std::string word;
-    while (ss >> word) {
-        if (isValidWord(dictionary, word)) {
-            count++;
+    /** Count the last word (if any) and return the counts. */
+    WordCounts finish() {
+        if (inWord) {
+            endWord(nullptr, 0);
+            inWord = false;
         }
+        return counts;
     }
-    return count;
-}
 
-// Removes excess whitespace and replaces them with single spaces
-std::string cutSpaces(const std::string& s) {
-  std::string result = boost::trim_copy(s);
-  while (result.find("  ") != result.npos) {
-    boost::replace_all(result, "  ", " ");
-  }
-  return result;
-}
+    /** Returns the best way to classify bytes on this CPU. */
+    static Simd bestSimd() {
+#if defined(__x86_64__)
+        return __builtin_cpu_supports("avx2") ? Simd::Avx2 : Simd::Sse2;
+#else
+        return Simd::Scalar;
+#endif
+    }
 
-// Takes data in and counts words after cutting whitespace and checking if
-// words are in english. A stream is used to write a string that will be
-// sent as output.
-std::string process(std::istream& is, std::ostream& os, std::string file) {
-    int wordCount = 0;
-    int english = 0;
-    std::string line;
-    StrVec dictionary = loadDictionary();
-    while (std::getline(is, line), line != "\r") {}
-    // Print HTTP response body with simple processing to filter-out
-    // chunk sizes in chunked responses.
-    while (std::getline(is, line)) {
-        line = changePunct(line);
-        line = cutSpaces(line);
-        wordCount += countWords(line);
-        english += countEnglish(line, dictionary);
+private:
+    // Returns true for bytes that are part of words.
+    static bool isWordChar(char c) {
+        const unsigned char u = c;
+        return !std::isspace(u) && !std::ispunct(u);
+    }
+
+    // Count a word that ended.  The word is (the end of) a word that
+    // started in an earlier block.
+    void endWord(const char* data, size_t size) {
+        if (partial.empty()) {
+            counts.english += isValidWord(dictionary, {data, size});
+        } else {
+            partial.append(data, size);
+            counts.english += isValidWord(dictionary, partial);
+            partial.clear();
+        }
     }
+
+    // Returns a mask with bit i set if byte i of the 64 bytes is part
+    // of a word.
+    using Classifier = uint64_t (*)(const char*);
+
+    static uint64_t scalarMask(const char* data) {
+        uint64_t mask = 0;
+        for (int i = 0; (i < 64); i++) {
+            mask |= uint64_t(isWordChar(data[i])) << i;
+        }
+        return mask;
+    }
+
+#if defined(__x86_64__)
+    // Sets bytes with lo <= c <= hi (unsigned) to 0xFF.
+    static __m128i inRange(__m128i c, char lo, char hi) {
+        const __m128i t = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+        return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(hi - lo)), t);
+    }
+
+    static uint64_t sse2Mask(const char* data) {
+        uint64_t mask = 0;
+        for (int i = 0; (i < 64); i += 16) {
+            const __m128i c = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(data + i));
+            // White space and the four ranges of punctuation.
+            const __m128i delim = _mm_or_si128(
+                _mm_or_si128(inRange(c, '\t', '\r'), inRange(c, ' ', '/')),
+                _mm_or_si128(_mm_or_si128(inRange(c, ':', '@'),
+                                          inRange(c, '[', '`')),
+                             inRange(c, '{', '~')));
+            mask |= uint64_t(~_mm_movemask_epi8(delim) & 0xFFFF) << i;
+        }
+        return mask;
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i inRange(__m256i c, char lo, char hi) {
+        const __m256i t = _mm256_sub_epi8(c, _mm256_set1_epi8(lo));
+        return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(hi -
+                                                                     lo)), t);
+    }
+
+    __attribute__((target("avx2")))
+    static uint64_t avx2Mask(const char* data) {
+        uint64_t mask = 0;
+        for (int i = 0; (i < 64); i += 32) {
+            const __m256i c = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(data + i));
+            const __m256i delim = _mm256_or_si256(
+                _mm256_or_si256(inRange(c, '\t', '\r'),
+                                inRange(c, ' ', '/')),
+                _mm256_or_si256(_mm256_or_si256(inRange(c, ':', '@'),
+                                                inRange(c, '[', '`')),
+                                inRange(c, '{', '~')));
+            mask |= uint64_t(~uint32_t(_mm256_movemask_epi8(delim))) << i;
+        }
+        return mask;
+    }
+#endif
+
+    static Classifier classifier(Simd simd) {
+#if defined(__x86_64__)
+        if (simd == Simd::Avx2) {
+            return avx2Mask;
+        } else if (simd == Simd::Sse2) {
+            return sse2Mask;
+        }
+#endif
+        return scalarMask;
+    }
+
+    const Dictionary& dictionary;
+    const Classifier classify;
+    WordCounts counts;
+    // True if the last byte added was part of a word.
+    bool inWord = false;
+    // The start of a word that spans blocks.
+    std::string partial;
+};
+
+// Returns the line of output with the counts for a file.
+std::string urlOutput(const std::string& file, const WordCounts& counts) {
     std::ostringstream out;
     out << "URL: http://ceclnx01.cec.miamioh.edu/~raodm/SlowGet.cgi?file=";
-    out << file << ", words: " << wordCount << ", English words: " << english;
-    std::string urlOutput = out.str();
-    return urlOutput;
+    out << file << ", words: " << counts.words << ", English words: "
+        << counts.english;
+    return out.str();
+}
+
+// Takes data in and counts words (and those that are in english using
+// the dictionary shared by all threads) with a WordCounter. A stream is
+// used to write a string that will be sent as output.
+std::string process(std::istream& is, std::ostream& os, std::string file,
+                    const Dictionary& dictionary) {
+    std::string line;
+    while (std::getline(is, line) && (line != "\r")) {}
+    // Count words in the HTTP response body a block at a time.  Chunk
+    // sizes in chunked responses are counted as words too.
+    WordCounter counter(dictionary);
+    char block[65536];
+    while (is.read(block, sizeof(block)) || (is.gcount() > 0)) {
+        counter.add(block, is.gcount());
+    }
+    return urlOutput(file, counter.finish());
 }
 
 // Does the actual work of connecting to the server with boost, then sends
 // the get request with headers 
-std::string execution(std::string URL) {
+std::string execution(std::string URL, const Dictionary& dictionary) {
     std::string output;
     const std::string host = 
     "ceclnx01.cec.miamioh.edu";
@@ -165,59 +626,556 @@ std::string execution(std::string URL) {
     stream << "Host: " << host << "\r\n";
     stream << "Connection: Close\r\n\r\n";
     // Process response from the server.  Skip header lines first.
-        output = process(stream, stream, URL);
+        output = process(stream, stream, URL, dictionary);
     }
     return output;
 }
 
-// Takes in the threads and lists, then stores the result of the word counts
-// in the results vector
-void thrMain(const FileList& list, URLOutput& results, const int startIdx,
-    const int count) {
-    int end = (startIdx + count);
-    for (int i = startIdx; (i < end); i++) {
+// The work done by one of the threads run by threadRun.
+struct WorkerStats {
+    // Number of URLs processed.
+    int urls = 0;
+    // Seconds spent processing URLs and in total.
+    double busy = 0, total = 0;
+};
+
+// Takes in the threads and lists, then repeatedly claims the next
+// unprocessed URL (via the shared counter) and stores the result of the
+// word counts at its index in the results vector until all URLs are
+// claimed.  Slow URLs thus hold up only the thread processing them.
+void thrMain(const FileList& list, URLOutput& results,
+             std::atomic<size_t>& next, WorkerStats& stats,
+             const Dictionary& dictionary) {
+    using Clock = std::chrono::steady_clock;
+    const auto start = Clock::now();
+    for (size_t i; ((i = next.fetch_add(1)) < list.size());) {
         // Executes the program to count words
-        results[i] = execution(list[i]);
+        const auto begin = Clock::now();
+        results[i] = ::execution(list[i], dictionary);
+        stats.busy += std::chrono::duration<double>(Clock::now() -
+                                                    begin).count();
+        stats.urls++;
     }
+    stats.total = std::chrono::duration<double>(Clock::now() -
+                                                start).count();
 }
+
 // Takes in a list of files to count words in, a blank vector results to write
-// output to, and the number of threads the user entered
-void threadRun(const FileList& list, URLOutput& results, int threadCount) {
-    // If threadCount is odd, add one more thread
-    if (threadCount % 2) {
-        threadCount++;
-    }
-    const int count = list.size() / threadCount;
+// output to, the number of threads the user entered, and the dictionary
+// shared (read-only) by all the threads.  Each URL is processed exactly
+// once and the results are in the same order as the list.  The work done
+// by each thread is reported on std::cerr.
+void threadRun(const FileList& list, URLOutput& results, int threadCount,
+               const Dictionary& dictionary) {
     results.resize(list.size());
+    std::atomic<size_t> next{0};
+    std::vector<WorkerStats> stats(std::max(1, threadCount));
     ThreadList thrList;
-    
-    for (int start = 0, thr = 0; (thr < threadCount); thr++, start += count) {
+    for (auto& workerStats : stats) {
         thrList.push_back(std::thread(thrMain, std::ref(list),
-                std::ref(results), start, count));
+                std::ref(results), std::ref(next), std::ref(workerStats),
+                std::cref(dictionary)));
     }
     for (auto& t : thrList) {
         t.join();
     }
+    for (size_t thr = 0; (thr < stats.size()); thr++) {
+        const WorkerStats& s = stats[thr];
+        std::cerr << "Thread " << thr << ": " << s.urls << " URLs, busy "
+                  << s.busy << " of " << s.total << " seconds ("
+                  << ((s.total > 0) ? (100 * s.busy / s.total) : 0)
+                  << "%)\n";
+    }
+}
+
+/**
+ * Fetches URLs from SlowGet.cgi asynchronously and counts the words in
+ * them.
+ *
+ * Up to a given number of requests are in flight at a time, each on its
+ * own HTTP/1.1 keep-alive connection to the host.  When a response is
+ * done its connection is reused for the next URL (or reopened if the
+ * server closed it).  The body of a response (de-chunked if need be) is
+ * counted with a WordCounter as its bytes arrive, so a single thread can
+ * keep many slow requests going.  Each request (including connecting)
+ * has a time limit.
+ */
+class FetchEngine {
+public:
+    /**
+     * Create an engine for a host.
+     *
+     * \param[in] dictionary The dictionary with the English words.
+     *
+     * \param[in] host The host running SlowGet.cgi.
+     *
+     * \param[in] timeout The time limit for each request.
+     */
+    FetchEngine(const Dictionary& dictionary, const std::string& host,
+                std::chrono::seconds timeout = std::chrono::seconds(60))
+        : dictionary(dictionary), host(host), timeout(timeout) {
+    }
+
+    /**
+     * Fetch the files and count the words in them.
+     *
+     * \param[in] files The files to be fetched from SlowGet.cgi.
+     *
+     * \param[in] connections The most requests in flight at a time.
+     *
+     * \param[in] threads The number of threads handling the responses.
+     *
+     * \return The output for each file, in the same order as files.
+     */
+    URLOutput fetchAll(const FileList& files, int connections,
+                       int threads = 1) const {
+        URLOutput results(files.size());
+        io_context io;
+        tcp::resolver resolver(io);
+        error_code ec;
+        const auto endpoints = resolver.resolve(host, "80", ec);
+        if (ec) {
+            std::fill(results.begin(), results.end(), "Error connecting\n");
+            return results;
+        }
+        Batch batch{files, results, endpoints, {0}};
+        const size_t count = std::min<size_t>(std::max(1, connections),
+                                              files.size());
+        for (size_t i = 0; (i < count); i++) {
+            std::make_shared<Connection>(*this, io, batch)->start();
+        }
+        ThreadList thrList;
+        for (int thr = 1; (thr < threads); thr++) {
+            thrList.push_back(std::thread([&io] { io.run(); }));
+        }
+        io.run();
+        for (auto& t : thrList) {
+            t.join();
+        }
+        return results;
+    }
+
+private:
+    // The files being fetched by fetchAll and their results.
+    struct Batch {
+        const FileList& files;
+        URLOutput& results;
+        const tcp::resolver::results_type endpoints;
+        // Index of the next file to be fetched.
+        std::atomic<size_t> next;
+    };
+
+    // A keep-alive connection that fetches files (the next one in the
+    // batch each time) until all of them are fetched.  All the handlers
+    // of a connection run on its own strand.
+    class Connection : public std::enable_shared_from_this<Connection> {
+    public:
+        Connection(const FetchEngine& engine, io_context& io, Batch& batch)
+            : engine(engine), batch(batch), socket(make_strand(io)),
+              timer(socket.get_executor()) {
+        }
+
+        void start() {
+            post(socket.get_executor(),
+                 [self = shared_from_this()] { self->nextRequest(); });
+        }
+
+    private:
+        // How the end of a response body is found.
+        enum class Framing { Length, Chunked, Close };
+        // The parts of a chunked body.
+        enum class Chunk { Size, Extension, Data, DataEnd, Trailer };
+
+        const std::string& file() const {
+            return batch.files[index];
+        }
+
+        void nextRequest() {
+            index = batch.next.fetch_add(1);
+            if (index >= batch.files.size()) {
+                error_code ignored;
+                timer.cancel();
+                socket.close(ignored);
+                return;
+            }
+            retried = false;
+            send();
+        }
+
+        // Sends the request for the current file, connecting first if
+        // the connection is not open.
+        void send() {
+            counter.emplace(engine.dictionary);
+            data.clear();
+            timedOut = false;
+            received = false;
+            timer.expires_after(engine.timeout);
+            timer.async_wait([self = shared_from_this(), id = ++requestId]
+                             (const error_code& ec) {
+                    if (!ec && (id == self->requestId)) {
+                        // Closing the socket aborts the pending operation.
+                        error_code ignored;
+                        self->timedOut = true;
+                        self->socket.close(ignored);
+                    }
+                });
+            reused = socket.is_open();
+            if (reused) {
+                write();
+                return;
+            }
+            async_connect(socket, batch.endpoints,
+                          [self = shared_from_this()]
+                          (const error_code& ec, const tcp::endpoint&) {
+                    if (ec) {
+                        self->failed(ec, true);
+                    } else {
+                        self->write();
+                    }
+                });
+        }
+
+        void write() {
+            request = "GET /~raodm/SlowGet.cgi?file=" + file() +
+                " HTTP/1.1\r\nHost: " + engine.host + "\r\n\r\n";
+            async_write(socket, buffer(request),
+                        [self = shared_from_this()]
+                        (const error_code& ec, size_t) {
+                    if (ec) {
+                        self->failed(ec);
+                    } else {
+                        self->readHeaders();
+                    }
+                });
+        }
+
+        void readHeaders() {
+            async_read_until(socket, dynamic_buffer(data, MaxHeaderSize),
+                             "\r\n\r\n", [self = shared_from_this()]
+                             (const error_code& ec, size_t size) {
+                    self->received = !self->data.empty();
+                    if (ec) {
+                        self->failed(ec);
+                    } else {
+                        self->parseHeaders(size);
+                    }
+                });
+        }
+
+        // Works out the framing of the body from the response headers in
+        // the first size bytes of data and counts the start of the body
+        // (if any) that was read with them.  A malformed Content-Length
+        // fails just this request.
+        void parseHeaders(size_t size) {
+            std::istringstream headers(data.substr(0, size));
+            std::string line;
+            std::getline(headers, line);
+            keepAlive = (line.compare(0, 8, "HTTP/1.1") == 0);
+            framing = Framing::Close;
+            while (std::getline(headers, line) && (line != "\r")) {
+                const size_t colon = line.find(':');
+                if (colon == std::string::npos) {
+                    continue;
+                }
+                const std::string name =
+                    boost::to_lower_copy(line.substr(0, colon));
+                const std::string value =
+                    boost::to_lower_copy(boost::trim_copy(
+                                             line.substr(colon + 1)));
+                if ((name == "content-length") && (framing == Framing::Close)) {
+                    const char* end = value.data() + value.size();
+                    const auto parsed = std::from_chars(value.data(), end,
+                                                        remaining);
+                    if ((parsed.ec != std::errc()) || (parsed.ptr != end)) {
+                        failed(make_error_code(errc::bad_message));
+                        return;
+                    }
+                    framing = Framing::Length;
+                } else if ((name == "transfer-encoding") &&
+                           (value.find("chunked") != std::string::npos)) {
+                    framing = Framing::Chunked;
+                    chunk = Chunk::Size;
+                    remaining = 0;
+                } else if (name == "connection") {
+                    keepAlive = (value.find("close") == std::string::npos);
+                }
+            }
+            if (framing == Framing::Close) {
+                keepAlive = false;  // The body ends when the server closes.
+            }
+            const std::string body = data.substr(size);
+            data.clear();
+            if (((framing == Framing::Length) && (remaining == 0)) ||
+                decode(body.data(), body.size())) {
+                done();
+            } else {
+                readBody();
+            }
+        }
+
+        void readBody() {
+            socket.async_read_some(buffer(block),
+                                   [self = shared_from_this()]
+                                   (const error_code& ec, size_t size) {
+                    if ((ec == error::eof) &&
+                        (self->framing == Framing::Close)) {
+                        self->done();
+                    } else if (ec) {
+                        self->failed(ec);
+                    } else if (self->decode(self->block.data(), size)) {
+                        self->done();
+                    } else {
+                        self->readBody();
+                    }
+                });
+        }
+
+        // Counts the words in the part of the body in the given bytes.
+        // Returns true if the end of the body was reached.
+        bool decode(const char* bytes, size_t size) {
+            if (framing == Framing::Close) {
+                counter->add(bytes, size);
+                return false;
+            }
+            if (framing == Framing::Length) {
+                const size_t count = std::min<uint64_t>(size, remaining);
+                counter->add(bytes, count);
+                remaining -= count;
+                return (remaining == 0);
+            }
+            for (const char *end = bytes + size; (bytes < end);) {
+                switch (chunk) {
+                case Chunk::Size:
+                    // Hex digits of the size of the next chunk.
+                    if (std::isxdigit(*bytes)) {
+                        const char digit = std::tolower(*bytes++);
+                        remaining = remaining * 16 + ((digit <= '9') ?
+                            (digit - '0') : (digit - 'a' + 10));
+                    } else {
+                        chunk = Chunk::Extension;
+                    }
+                    break;
+                case Chunk::Extension:
+                    // Skip the rest of the size line.
+                    if (*bytes++ == '\n') {
+                        chunk = (remaining > 0) ? Chunk::Data : Chunk::Trailer;
+                        lineLength = 0;
+                    }
+                    break;
+                case Chunk::Data: {
+                    const size_t count =
+                        std::min<uint64_t>(end - bytes, remaining);
+                    counter->add(bytes, count);
+                    bytes += count;
+                    remaining -= count;
+                    if (remaining == 0) {
+                        chunk = Chunk::DataEnd;
+                    }
+                    break;
+                }
+                case Chunk::DataEnd:
+                    // Skip the CRLF after the data of a chunk.
+                    if (*bytes++ == '\n') {
+                        chunk = Chunk::Size;
+                    }
+                    break;
+                case Chunk::Trailer:
+                    // Trailer lines up to an empty line end the body.
+                    if (*bytes == '\n') {
+                        if (lineLength == 0) {
+                            return true;
+                        }
+                        lineLength = 0;
+                    } else if (*bytes != '\r') {
+                        lineLength++;
+                    }
+                    bytes++;
+                    break;
+                }
+            }
+            return false;
+        }
+
+        // Stores the counts for the current file and moves on.
+        void done() {
+            batch.results[index] = urlOutput(file(), counter->finish());
+            if (!keepAlive) {
+                error_code ignored;
+                socket.close(ignored);
+            }
+            nextRequest();
+        }
+
+        // Stores the error for the current file and moves on.  A request
+        // on a reused connection that the server had already closed
+        // (without any response) is retried once on a new connection.
+        // Once any of the response has arrived the request is never
+        // retried, as SlowGet.cgi would run (and be counted) again.
+        void failed(const error_code& ec, bool connecting = false) {
+            error_code ignored;
+            socket.close(ignored);
+            if (reused && !retried && !timedOut && !received) {
+                retried = true;
+                send();
+                return;
+            }
+            if (timedOut) {
+                batch.results[index] = "Timed out fetching " + file() + "\n";
+            } else if (connecting) {
+                // Same as the output of execution.
+                batch.results[index] = "Error connecting\n";
+            } else {
+                batch.results[index] = "Error fetching " + file() + ": " +
+                    ec.message() + "\n";
+            }
+            nextRequest();
+        }
+
+        // The largest response headers accepted.
+        static constexpr size_t MaxHeaderSize = 65536;
+
+        const FetchEngine& engine;
+        Batch& batch;
+        tcp::socket socket;
+        steady_timer timer;
+        // Index of the file being fetched (in batch.files).
+        size_t index = 0;
+        // Number of the current request, to ignore stale timeouts.
+        uint64_t requestId = 0;
+        bool reused = false, retried = false, timedOut = false;
+        // True once any bytes of the response have been read.
+        bool received = false;
+        bool keepAlive = false;
+        std::string request;
+        // Response bytes read with the headers.
+        std::string data;
+        std::array<char, 65536> block;
+        Framing framing = Framing::Close;
+        Chunk chunk = Chunk::Size;
+        // Bytes left in the body (Length) or the current chunk (Chunked).
+        uint64_t remaining = 0;
+        // Length of the current trailer line.
+        size_t lineLength = 0;
+        std::optional<WordCounter> counter;
+    };
+
+    const Dictionary& dictionary;
+    const std::string host;
+    const std::chrono::seconds timeout;
+};
+
+// The line-by-line counting (replacing punctuation, collapsing spaces,
+// and splitting each line twice with std::stringstream) used before
+// WordCounter.  Kept as the baseline for runBenchmark.
+WordCounts baselineCount(const std::string& text,
+                         const Dictionary& dictionary) {
+    WordCounts counts;
+    std::istringstream is(text);
+    std::string line, word;
+    while (std::getline(is, line)) {
+        std::replace_if(line.begin(), line.end(), ispunct, ' ');
+        line = boost::trim_copy(line);
+        while (line.find("  ") != line.npos) {
+            boost::replace_all(line, "  ", " ");
+        }
+        std::stringstream words(line), english(line);
+        while (words >> word) {
+            counts.words++;
+        }
+        while (english >> word) {
+            counts.english += isValidWord(dictionary, word);
+        }
+    }
+    return counts;
+}
+
+// Times counting the words in a file (english.txt by default) with the
+// baseline and each way of classifying bytes and reports the counts and
+// throughput in MB/s.
+void runBenchmark(const std::string& filePath,
+                  const Dictionary& dictionary) {
+    std::ifstream file(filePath, std::ios::binary);
+    const std::string text((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+    const auto measure = [&text](const std::string& name, auto count) {
+        using namespace std::chrono;
+        // Repeat for at least half a second for stable numbers.
+        WordCounts counts;
+        int runs = 0;
+        const auto start = steady_clock::now();
+        duration<double> elapsed;
+        do {
+            counts = count();
+            runs++;
+            elapsed = steady_clock::now() - start;
+        } while (elapsed.count() < 0.5);
+        std::cout << name << ": words: " << counts.words << ", English words: "
+                  << counts.english << ", " << (text.size() * runs / 1e6) /
+            elapsed.count() << " MB/s\n";
+    };
+    std::cout << filePath << ": " << text.size() << " bytes\n";
+    measure("baseline", [&] { return baselineCount(text, dictionary); });
+    const std::pair<const char*, Simd> modes[] = {{"scalar", Simd::Scalar},
+        {"sse2", Simd::Sse2}, {"avx2", Simd::Avx2}};
+    for (const auto& mode : modes) {
+        if ((mode.second == Simd::Avx2) &&
+            (WordCounter::bestSimd() != Simd::Avx2)) {
+            continue;  // Not supported by this CPU.
+        }
+        measure(mode.first, [&] {
+                WordCounter counter(dictionary, mode.second);
+                counter.add(text.data(), text.size());
+                return counter.finish();
+            });
+    }
 }
 
 int main(int argc, char** argv) {
+    if ((argc == 4) && (argv[1] == std::string("--compile"))) {
+        // Precompile a word list, e.g.,
+        // homework6 --compile english.txt english.txt.idx
+        if (!compileDictionary(argv[2], argv[3])) {
+            std::cerr << "Unable to compile " << argv[2] << " into "
+                      << argv[3] << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if ((argc >= 2) && (argv[1] == std::string("--bench"))) {
+        // Measure word counting, e.g., homework6 --bench english.txt
+        runBenchmark((argc > 2) ? argv[2] : "english.txt", loadDictionary());
+        return 0;
+    }
+    if ((argc >= 3) && (argv[1] == std::string("--async"))) {
+        // Fetch asynchronously with up to the given number of requests
+        // in flight, e.g., homework6 --async 16 file1 file2 ...
+        const FileList files(argv + 3, argv + argc);
+        const Dictionary dictionary = loadDictionary();
+        const FetchEngine engine(dictionary, "ceclnx01.cec.miamioh.edu");
+        for (const auto& result : engine.fetchAll(files, std::stoi(argv[2]))) {
+            std::cout << result << std::endl;
+        }
+        return 0;
+    }
     int totalInputs = argc;
     int count = std::stoi(argv[1]);
     std::vector<std::string> dataInputs;
     for (int i = 2; i < totalInputs; i++) {
        dataInputs.push_back(argv[i]);
     }
+    // Load the dictionary just once for all the URLs.
+    const Dictionary dictionary = loadDictionary();
     if (count > 1) { 
         std::vector<std::string> results;
         std::vector<std::string> list;
-        threadRun(dataInputs, results, count);
+        threadRun(dataInputs, results, count, dictionary);
         for (size_t i = 0; i < results.size(); i++) {
             std::cout << results[i] << std::endl;
         }
     } else {
         for (size_t i = 0; i < dataInputs.size(); i++) {
             std::string input = dataInputs[i];
-            std::cout << execution(input) << std::endl;
+            std::cout << ::execution(input, dictionary) << std::endl;
         }
     }
     return 0;
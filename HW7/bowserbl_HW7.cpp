@@ -10,414 +10,4316 @@
  * Copyright (C) 2018 raodm@miamiOH.edu
  */
 
-#include <ext/stdio_filebuf.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <zlib.h>
+#include <csignal>
 #include <boost/asio.hpp>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <memory>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <cmath>
 
 // Using namespaces to streamline code below
 using namespace std;
 using namespace boost::asio;
 using namespace boost::asio::ip;
 
+// shared_ptr is a garbage collected pointer!
+using TcpStreamPtr = std::shared_ptr<tcp::iostream>;
+
+/** Settings for compressing responses (see ChunkedStreamBuf and
+    StaticCache).
+ */
+struct CompressionConfig {
+    // The zlib compression level (1-9), or 0 to never compress.
+    int level = 6;
+    // Smallest response (when its size is known) worth compressing.
+    size_t minSize = 1024;
+    // The mime types that are compressed.  Types such as images are
+    // already compressed and are left as-is.
+    std::vector<std::string> types = {"text/html", "text/plain", "text/css",
+        "text/csv", "application/javascript", "application/json",
+        "image/svg+xml"};
+
+    /** Returns true if a response of the given type and size (or
+        std::string::npos if not known) should be compressed.
+     */
+    bool allows(std::string_view mimeType, size_t size) const {
+        if ((level == 0) || (size < minSize)) {
+            return false;
+        }
+        mimeType = mimeType.substr(0, mimeType.find(';'));
+        return std::find(types.begin(), types.end(), mimeType) != types.end();
+    }
+};
+
+/** Tunable settings for the server.
+
+    The values are set from "--name=value" options in the HW7_OPTIONS
+    environment variable (see parseOptions), e.g.,
+    HW7_OPTIONS="--async --workers=8" ./hw7 8080.  The command line
+    itself is left as-is.  By default the server runs in the original
+    thread-per-connection mode; "--async" switches to the event-loop
+    mode implemented by AsyncServer below and "--shards" runs several
+    such servers (see runShardedServer).
+ */
+struct ServerConfig {
+    // Use the Asio event loop and a bounded worker pool.
+    bool async = false;
+    // Number of independent SO_REUSEPORT listeners (0 for just one).
+    int shards = 0;
+    // Number of threads running the io_service event loop.
+    int ioThreads = std::max(1u, std::thread::hardware_concurrency());
+    // Number of worker threads that process requests.
+    int workers = 4 * std::max(1u, std::thread::hardware_concurrency());
+    // Maximum number of connections accepted at any one time.
+    size_t maxConnections = 1024;
+    // Maximum number of ready connections waiting for a free worker.
+    size_t queueDepth = 256;
+    // Seconds a persistent connection may stay idle between requests.
+    int idleTimeout = 5;
+    // Maximum number of requests served on one connection.
+    int maxRequests = 100;
+    // Maximum number of bytes of static files cached in memory.
+    size_t cacheBytes = 64 << 20;
+    // Largest block of data sent as one HTTP chunk.
+    size_t chunkSize = 16 << 10;
+    // Maximum number of CGI commands running at the same time.
+    size_t cgiMaxRunning = 16;
+    // Maximum number of CGI requests waiting for a running slot.
+    size_t cgiMaxWaiting = 64;
+    // Milliseconds between samples of a CGI command's statistics.
+    int sampleInterval = 1000;
+    // Number of recent samples kept for each CGI command.
+    size_t maxSamples = 3600;
+    // Seconds a CGI command may run before it is killed (0 for no limit).
+    int cgiWallLimit = 600;
+    // CPU seconds a CGI command may use (0 for no limit).
+    int cgiCpuLimit = 300;
+    // Bytes of memory (combined RSS of its processes) a CGI command may
+    // use (0 for no limit).  Enforced by sampling (see ChildMonitor).
+    size_t cgiMemLimit = size_t(1) << 30;
+    // Bytes of address space each CGI process may reserve (0 for no
+    // limit).  Enforced by the kernel (RLIMIT_AS), but programs that
+    // reserve large ranges up front (JVMs, Go, ASan) fail to start.
+    size_t cgiAddressLimit = 0;
+    // Bytes of output kept in memory for each submitted (async) job.
+    size_t spoolBytes = 1 << 20;
+    // Seconds the results of a submitted job are kept after it exits.
+    int jobTtl = 300;
+    // Maximum number of submitted jobs kept.  When full, the oldest
+    // finished job is dropped (or the submission refused if none has
+    // finished).
+    size_t maxJobs = 64;
+    // Commands whose cgi-bin/exec responses may be cached, along with
+    // the seconds to keep them (0 to use cacheTtl).
+    std::map<std::string, int> cacheCmds;
+    // Default seconds a cached CGI response is used.
+    int cacheTtl = 5;
+    // When and how responses are compressed.
+    CompressionConfig compression;
+    // Add headers with the (varying) times taken to start CGI commands.
+    bool timingHeaders = true;
+};
+
+/** The ways in which the output of a CGI command can be returned. */
+enum class CgiOutput {
+    Html,         // An HTML page with output, statistics, and chart.
+    Json,         // A JSON object with output, exit code, and samples.
+    Csv,          // A CSV table of samples (exit code in a header).
+    EventStream   // Server-Sent Events sent as the command runs.
+};
+
+/** A latency histogram with logarithmic buckets (in the style of
+    HdrHistogram).
+
+    Each power of two is split into 2^SubBits linear buckets, so
+    values are recorded with a relative error of at most 12.5% over
+    the whole range from 1 microsecond to days.  Recording is a couple
+    of bit operations plus relaxed atomic increments, i.e., cheap
+    enough to always be on.
+ */
+class LatencyHistogram {
+public:
+    // Number of linear buckets per power of two is 2^SubBits.
+    static const int SubBits = 3;
+    // Values up to 2^MaxExp microseconds are kept apart.
+    static const int MaxExp = 40;
+    // Total number of buckets.
+    static const size_t Buckets = (MaxExp - SubBits + 1) << SubBits;
+
+    /** Add a value (in microseconds) to the histogram. */
+    void record(uint64_t usec) {
+        counts[bucket(usec)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(usec, std::memory_order_relaxed);
+    }
+
+    /** Add the counts from this histogram to the totals.
+
+        \param[in,out] totals The per-bucket totals (Buckets entries).
+
+        \param[in,out] sumTotal The total of all values recorded.
+     */
+    void addTo(std::vector<uint64_t>& totals, uint64_t& sumTotal) const {
+        for (size_t i = 0; (i < Buckets); i++) {
+            totals[i] += counts[i].load(std::memory_order_relaxed);
+        }
+        sumTotal += sum.load(std::memory_order_relaxed);
+    }
+
+    /** Returns the bucket in which a value is recorded. */
+    static size_t bucket(uint64_t usec) {
+        if (usec < (1u << SubBits)) {
+            return usec;
+        }
+        const int exp = 63 - __builtin_clzll(usec);
+        const size_t idx = (static_cast<size_t>(exp - SubBits + 1) << SubBits)
+            + ((usec >> (exp - SubBits)) & ((1u << SubBits) - 1));
+        return std::min(idx, Buckets - 1);
+    }
+
+    /** Returns the largest value that is recorded in a bucket. */
+    static uint64_t highestValue(size_t idx) {
+        return lowestValue(idx + 1) - 1;
+    }
+
+private:
+    // Returns the smallest value that is recorded in a bucket.
+    static uint64_t lowestValue(size_t idx) {
+        if (idx < (1u << SubBits)) {
+            return idx;
+        }
+        const int exp = (idx >> SubBits) + SubBits - 1;
+        return ((1ull << SubBits) + (idx & ((1u << SubBits) - 1)))
+            << (exp - SubBits);
+    }
+
+    std::atomic<uint64_t> counts[Buckets] = {};
+    std::atomic<uint64_t> sum{0};
+};
+
+/** The kinds of requests for which latencies are tracked. */
+enum class Route { Static, Cgi, NotFound, Metrics, BadRequest, Jobs, Count };
+
+/** The counters and gauges maintained by the server. */
+enum class Stat {
+    ConnectionsAccepted,  // Connections accepted.
+    ConnectionsActive,    // Connections currently open.
+    HandlersBusy,         // Threads currently serving requests.
+    BytesSent,            // Bytes sent to clients.
+    CgiSpawned,           // CGI commands started.
+    CgiSpawnFailed,       // CGI commands that could not be started.
+    CgiRejected,          // CGI requests refused as too many were queued.
+    CgiExited,            // CGI commands that finished.
+    CgiCacheHits,         // CGI requests answered from cgiResults.
+    CgiCacheMisses,       // Cacheable CGI requests that ran the command.
+    Count
+};
+
+/** Statistics for one listener of a sharded server (see
+    runShardedServer).  Each is updated only by the threads of its
+    own listener.
+ */
+struct alignas(64) ListenerStats {
+    std::atomic<uint64_t> accepted{0}, rejected{0}, requests{0};
+    std::atomic<int64_t> active{0};
+};
+
+/** Server statistics reported by the /metrics route in the Prometheus
+    text format.
+
+    To keep recording cheap and contention free, the statistics are
+    split into cache-line aligned shards and each thread updates only
+    its own shard using relaxed atomic operations.  The shards are
+    added up only when the metrics are requested.  Gauges are
+    incremented and decremented (possibly in different shards) and so
+    are kept as signed values.
+ */
+class ServerMetrics {
+public:
+    /** Add a value to a counter (or gauge). */
+    void add(Stat stat, int64_t value = 1) {
+        shard().stats[static_cast<int>(stat)].fetch_add(
+            value, std::memory_order_relaxed);
+    }
+
+    /** Record the time taken to respond to a request. */
+    void recordRequest(Route route, uint64_t usec) {
+        shard().latency[static_cast<int>(route)].record(usec);
+    }
+
+    /** Record the time taken to start a CGI command. */
+    void recordCgiSpawn(uint64_t usec) {
+        shard().cgiSpawn.record(usec);
+    }
+
+    /** Record the time from the start to the exit of a CGI command. */
+    void recordCgiRun(uint64_t usec) {
+        shard().cgiRun.record(usec);
+    }
+
+    /** Set up the statistics for the listeners of a sharded server.
+        Must be called before any of the listeners are started.
+     */
+    void setListeners(size_t count) {
+        listeners.reset(new ListenerStats[count]);
+        listenerCount = count;
+    }
+
+    /** Obtain the statistics for a listener of a sharded server. */
+    ListenerStats& listener(size_t index) {
+        return listeners[index];
+    }
+
+    /** Write the metrics in Prometheus text exposition format. */
+    void write(std::ostream& os) const {
+        static const char* const StatNames[] = {
+            "connections_accepted_total", "connections_active",
+            "handlers_busy", "bytes_sent_total", "cgi_spawned_total",
+            "cgi_spawn_failures_total", "cgi_rejected_total",
+            "cgi_exited_total", "cgi_cache_hits_total",
+            "cgi_cache_misses_total"};
+        static const char* const RouteNames[] = {
+            "static", "cgi", "not_found", "metrics", "bad_request", "jobs"};
+        for (int i = 0; (i < static_cast<int>(Stat::Count)); i++) {
+            int64_t total = 0;
+            for (const Shard& s : shards) {
+                total += s.stats[i].load(std::memory_order_relaxed);
+            }
+            const bool isGauge = (std::strstr(StatNames[i], "_total") ==
+                                  nullptr);
+            os << "# TYPE hw7_" << StatNames[i]
+               << (isGauge ? " gauge\n" : " counter\n")
+               << "hw7_" << StatNames[i] << ' ' << total << '\n';
+        }
+        os << "# TYPE hw7_request_duration_seconds summary\n";
+        for (int r = 0; (r < static_cast<int>(Route::Count)); r++) {
+            writeSummary(os, "hw7_request_duration_seconds",
+                         std::string("route=\"") + RouteNames[r] + "\"",
+                         [r](const Shard& s) -> const LatencyHistogram& {
+                             return s.latency[r]; });
+        }
+        os << "# TYPE hw7_cgi_spawn_duration_seconds summary\n";
+        writeSummary(os, "hw7_cgi_spawn_duration_seconds", "",
+                     [](const Shard& s) -> const LatencyHistogram& {
+                         return s.cgiSpawn; });
+        os << "# TYPE hw7_cgi_run_duration_seconds summary\n";
+        writeSummary(os, "hw7_cgi_run_duration_seconds", "",
+                     [](const Shard& s) -> const LatencyHistogram& {
+                         return s.cgiRun; });
+        writeListeners(os);
+    }
+
+private:
+    // Number of shards; threads beyond this share shards.
+    static const size_t Shards = 16;
+
+    // The statistics updated by one (or a few) threads.
+    struct alignas(64) Shard {
+        std::atomic<int64_t> stats[static_cast<int>(Stat::Count)] = {};
+        LatencyHistogram latency[static_cast<int>(Route::Count)];
+        LatencyHistogram cgiSpawn, cgiRun;
+    };
+
+    // Returns the shard used by the calling thread.
+    Shard& shard() {
+        thread_local Shard& mine = shards[nextShard++ % Shards];
+        return mine;
+    }
+
+    // Write one summary (with the p50, p99, and p99.9 quantiles) from
+    // the histograms returned by getHist for each shard.
+    template<typename GetHist>
+    void writeSummary(std::ostream& os, const std::string& name,
+                      const std::string& labels, GetHist getHist) const {
+        std::vector<uint64_t> totals(LatencyHistogram::Buckets);
+        uint64_t sum = 0;
+        for (const Shard& s : shards) {
+            getHist(s).addTo(totals, sum);
+        }
+        uint64_t count = 0;
+        for (uint64_t c : totals) {
+            count += c;
+        }
+        const std::string sep = labels.empty() ? "" : ",";
+        for (const double q : {0.5, 0.99, 0.999}) {
+            os << name << '{' << labels << sep << "quantile=\"" << q
+               << "\"} " << quantile(totals, count, q) / 1e6 << '\n';
+        }
+        const std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        os << name << "_sum" << braces << ' ' << sum / 1e6 << '\n'
+           << name << "_count" << braces << ' ' << count << '\n';
+    }
+
+    // Write the statistics of each listener of a sharded server.
+    void writeListeners(std::ostream& os) const {
+        if (listenerCount == 0) {
+            return;
+        }
+        using Field = const std::atomic<uint64_t> ListenerStats::*;
+        const std::pair<const char*, Field> counters[] = {
+            {"shard_connections_accepted_total", &ListenerStats::accepted},
+            {"shard_connections_rejected_total", &ListenerStats::rejected},
+            {"shard_requests_total", &ListenerStats::requests}};
+        for (const auto& counter : counters) {
+            os << "# TYPE hw7_" << counter.first << " counter\n";
+            for (size_t i = 0; (i < listenerCount); i++) {
+                os << "hw7_" << counter.first << "{shard=\"" << i << "\"} "
+                   << (listeners[i].*counter.second).load(
+                       std::memory_order_relaxed) << '\n';
+            }
+        }
+        os << "# TYPE hw7_shard_connections_active gauge\n";
+        for (size_t i = 0; (i < listenerCount); i++) {
+            os << "hw7_shard_connections_active{shard=\"" << i << "\"} "
+               << listeners[i].active.load(std::memory_order_relaxed)
+               << '\n';
+        }
+    }
+
+    // Returns the value (in microseconds) below which the fraction q
+    // of the recorded values fall.
+    static uint64_t quantile(const std::vector<uint64_t>& totals,
+                             uint64_t count, double q) {
+        const uint64_t rank = std::max<uint64_t>(1, std::ceil(q * count));
+        uint64_t seen = 0;
+        for (size_t i = 0; (i < totals.size()); i++) {
+            if ((seen += totals[i]) >= rank) {
+                return LatencyHistogram::highestValue(i);
+            }
+        }
+        return 0;  // No values recorded.
+    }
+
+    Shard shards[Shards];
+    std::atomic<size_t> nextShard{0};
+    std::unique_ptr<ListenerStats[]> listeners;
+    size_t listenerCount = 0;
+};
+
+// The statistics for the whole server.
+ServerMetrics metrics;
+
+/** An output stream buffer that counts the bytes written through it.
+
+    The buffer has no storage of its own: every write is passed
+    straight on to the destination buffer, so counting costs one extra
+    virtual call per write rather than a copy of the data.
+ */
+class CountingStreamBuf : public std::streambuf {
+public:
+    explicit CountingStreamBuf(std::streambuf* dest) : dest(dest) {}
+
+    /** Returns the number of bytes written so far. */
+    uint64_t getCount() const {
+        return count;
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) {
+            return traits_type::not_eof(ch);
+        }
+        count++;
+        return dest->sputc(traits_type::to_char_type(ch));
+    }
+
+    std::streamsize xsputn(const char* data, std::streamsize n) override {
+        const std::streamsize written = dest->sputn(data, n);
+        count += written;
+        return written;
+    }
+
+    int sync() override {
+        return dest->pubsync();
+    }
+
+private:
+    std::streambuf* const dest;
+    uint64_t count = 0;
+};
+
+/** Returns the settings used to process a request read from a file
+    (for functional testing).  Responses are not compressed and have
+    no timing headers, so that they can be compared with the expected
+    outputs.
+ */
+ServerConfig fileTestConfig() {
+    ServerConfig config;
+    config.compression.level = 0;
+    config.timingHeaders     = false;
+    return config;
+}
+
 // Forward declaration for method defined further below
-void serveClient(std::istream& is, std::ostream& os, bool genFlag);
+bool serveClient(std::istream& is, std::ostream& os, bool genFlag,
+                 const ServerConfig& config = fileTestConfig(),
+                 bool persistent = false,
+                 int sockFd = -1);
+
+// The cache of static files used by the calling thread (defined below).
+class StaticCache;
+extern thread_local StaticCache* localFiles;
+
+/** Wait for the client to send more data.
+
+    \param[in] client The client connection to check.  Data already
+    buffered in the stream (i.e., a pipelined request) counts as
+    available.
+
+    \param[in] timeout Maximum number of seconds to wait.
+
+    \return This method returns true if data is available to read.
+ */
+bool waitForData(tcp::iostream& client, int timeout) {
+    if (client.rdbuf()->in_avail() > 0) {
+        return true;
+    }
+    pollfd pfd = {client.socket().native_handle(), POLLIN, 0};
+    return poll(&pfd, 1, timeout * 1000) > 0;
+}
+
+/** Serve one or more requests on a persistent connection.
+
+    Requests are answered in the order they were received, so
+    pipelined requests are handled naturally.  The connection is kept
+    open only while the client asks for it (via the Connection
+    header) and the configured per-connection request limit has not
+    been reached.
+
+    \param[in,out] client The client connection to be processed.
+
+    \param[in] config The server settings with the idle timeout and
+    request limits.
+
+    \param[in,out] served The number of requests served so far on
+    this connection.
+
+    \param[in] idleWait If true, block (up to the idle timeout) for
+    the next request.  Otherwise return as soon as no further request
+    is buffered so the caller can wait for data elsewhere.
+
+    \return This method returns true if the connection is still open
+    and can serve more requests.
+ */
+bool serveConnection(tcp::iostream& client, const ServerConfig& config,
+                     int& served, bool idleWait) {
+    // Responses are written via a counter to track the bytes sent.
+    CountingStreamBuf counter(client.rdbuf());
+    std::ostream out(&counter);
+    metrics.add(Stat::HandlersBusy);
+    bool open = true;
+    while (open) {
+        const bool persistent = (++served < config.maxRequests);
+        open = serveClient(client, out, true, config, persistent,
+                           client.socket().native_handle());
+        if (!open || (client.rdbuf()->in_avail() > 0)) {
+            continue;  // Closed or pipelined request is already waiting.
+        }
+        if (!idleWait) {
+            break;
+        }
+        open = waitForData(client, config.idleTimeout);  // Idle too long?
+    }
+    metrics.add(Stat::HandlersBusy, -1);
+    metrics.add(Stat::BytesSent, counter.getCount());
+    return open;
+}
+
+/** Simple method to be run from a separate thread.
+ *
+ * @param client The client socket to be processed.
+ * @param config The server settings to be used.
+ */
+void threadMain(TcpStreamPtr client, const ServerConfig config) {
+    metrics.add(Stat::ConnectionsAccepted);
+    metrics.add(Stat::ConnectionsActive);
+    // Call routine/regular helper method.
+    int served = 0;
+    if (waitForData(*client, config.idleTimeout)) {
+        serveConnection(*client, config, served, true);
+    }
+    metrics.add(Stat::ConnectionsActive, -1);
+}
+
+/**
+ * Runs the program as a server that listens to incoming connections,
+ * with a thread for each connection.
+ * 
+ * @param port The port number on which the server should listen.
+ * @param config The server settings to be used.
+ */
+void runThreadedServer(int port, const ServerConfig& config) {
+    // Setup a server socket to accept connections on the socket
+    io_service service;
+    // Create end point
+    tcp::endpoint myEndpoint(tcp::v4(), port);
+    // Create a socket that accepts connections
+    tcp::acceptor server(service, myEndpoint);
+    std::cout << "Server is listening on " << port 
+              << " & ready to process clients...\n";
+    // Process client connections one-by-one...forever
+    while (true) {
+        // Create garbage-collect object on heap
+        TcpStreamPtr client = std::make_shared<tcp::iostream>();
+        // Wait for a client to connect
+        server.accept(*client->rdbuf());
+        // Create a separate thread to process the client.
+        std::thread thr(threadMain, client, config);
+        thr.detach();
+    }
+}
+
+/** A fixed-size pool of threads processing connections from a bounded
+    queue.
+
+    The event loop hands connections to the pool via submit().  If the
+    queue is already full, submit() refuses the connection so that the
+    caller can shed load instead of piling up work.  The workers use
+    the static file cache (and CPU affinity) of the thread creating the
+    pool.
+ */
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    WorkerPool(int workers, size_t queueDepth) : maxQueued(queueDepth) {
+        StaticCache* const files = localFiles;
+        for (int i = 0; (i < workers); i++) {
+            threads.emplace_back([this, files] {
+                    localFiles = files;
+                    run();
+                });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueCond.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    /** Add a task to the queue.
+
+        \return This method returns false (without queuing the task)
+        if the queue is already at its maximum depth.
+     */
+    bool submit(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (queue.size() >= maxQueued) {
+                return false;
+            }
+            queue.push_back(std::move(task));
+        }
+        queueCond.notify_one();
+        return true;
+    }
+
+private:
+    // The main method for each worker thread.
+    void run() {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCond.wait(lock, [this] {
+                    return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;  // Stopping and no more work left.
+                }
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            task();
+        }
+    }
+
+    const size_t maxQueued;
+    std::vector<std::thread> threads;
+    std::deque<Task> queue;
+    std::mutex queueMutex;
+    std::condition_variable queueCond;
+    bool stopping = false;
+};
+
+/** An event-driven server built on the io_service.
+
+    Connections are accepted with async_accept and parked in the event
+    loop (via async_wait) until the client has sent data.  Only then is
+    the connection handed to a WorkerPool thread that runs serveClient.
+    Idle clients therefore do not tie up a thread.  Connections beyond
+    the configured limits are answered with a 503 and closed.
+ */
+class AsyncServer {
+public:
+    using SocketPtr = std::shared_ptr<tcp::socket>;
+
+    /** Create the server.
+
+        \param[in] service The event loop for the server.
+
+        \param[in] port The port on which to listen.
+
+        \param[in] config The settings for the server.
+
+        \param[in] stats If not null, the server is one of several
+        listening on the same port (via SO_REUSEPORT) and its
+        statistics are also kept here.
+     */
+    AsyncServer(io_service& service, int port, const ServerConfig& config,
+                ListenerStats* stats = nullptr)
+        : service(service), config(config),
+          acceptor(listen(service, port, stats != nullptr)), stats(stats),
+          pool(config.workers, config.queueDepth) {
+    }
+
+    /** Start accepting connections.  The caller must run the
+        io_service for the accepts to be processed.
+     */
+    void start() {
+        accept();
+    }
+
+private:
+    // Create the acceptor, letting other acceptors share the port if
+    // requested.
+    static tcp::acceptor listen(io_service& service, int port,
+                                bool reusePort) {
+        const tcp::endpoint endpoint(tcp::v4(), port);
+        tcp::acceptor acceptor(service, endpoint.protocol());
+        acceptor.set_option(socket_base::reuse_address(true));
+        if (reusePort) {
+            const int on = 1;
+            setsockopt(acceptor.native_handle(), SOL_SOCKET, SO_REUSEPORT,
+                       &on, sizeof(on));
+        }
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        return acceptor;
+    }
+
+    // Issue an asynchronous accept for the next client connection.
+    // Each connection gets its own strand on which its timer and wait
+    // handlers run, so they never race each other across I/O threads.
+    void accept() {
+        SocketPtr socket = std::make_shared<tcp::socket>(make_strand(service));
+        acceptor.async_accept(*socket,
+            [this, socket](const boost::system::error_code& ec) {
+                if (!ec) {
+                    admit(socket);
+                }
+                accept();
+            });
+    }
+
+    // Enforce the connection limit before waiting for a request.
+    void admit(SocketPtr socket) {
+        metrics.add(Stat::ConnectionsAccepted);
+        metrics.add(Stat::ConnectionsActive);
+        if (stats != nullptr) {
+            stats->accepted.fetch_add(1, std::memory_order_relaxed);
+            stats->active.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (++active > config.maxConnections) {
+            reject(socket);
+            return;
+        }
+        waitForRequest(socket, 0);
+    }
+
+    // Wait in the event loop (up to the idle timeout) for the client
+    // to send a request and then queue the connection for a worker.
+    // The timer and the wait both run on the socket's strand.  Once
+    // the connection is handed to a worker (which moves the socket)
+    // the timer must no longer touch the socket.
+    void waitForRequest(SocketPtr socket, int served) {
+        auto timer = std::make_shared<steady_timer>(socket->get_executor(),
+            std::chrono::seconds(config.idleTimeout));
+        auto handedOff = std::make_shared<bool>(false);
+        timer->async_wait([socket, handedOff](const boost::system::error_code&
+                                              ec) {
+            if (!ec && !*handedOff) {
+                boost::system::error_code ignored;
+                socket->cancel(ignored);  // Idle for too long.
+            }
+        });
+        socket->async_wait(tcp::socket::wait_read,
+            [this, socket, timer, handedOff, served](
+                const boost::system::error_code& ec) {
+                timer->cancel();
+                *handedOff = true;
+                if (ec) {
+                    closed();  // Idle or closed; socket closes itself.
+                } else if (!pool.submit([this, socket, served] {
+                            serve(socket, served); })) {
+                    reject(socket);
+                }
+            });
+    }
+
+    // Run the request(s) on the connection from a worker thread.
+    // Once no more requests are buffered the socket is handed back
+    // to the event loop so that idle keep-alive connections do not
+    // hold on to a worker.
+    void serve(SocketPtr socket, int served) {
+        tcp::iostream client(std::move(*socket));
+        const int before = served;
+        const bool open  = serveConnection(client, config, served, false);
+        if (stats != nullptr) {
+            stats->requests.fetch_add(served - before,
+                                      std::memory_order_relaxed);
+        }
+        if (open) {
+            boost::system::error_code ec;
+            socket->assign(tcp::v4(), client.socket().release(), ec);
+            if (!ec) {
+                waitForRequest(socket, served);
+                return;
+            }
+        }
+        closed();
+    }
+
+    // Shed load by telling the client to try again later.
+    void reject(SocketPtr socket) {
+        if (stats != nullptr) {
+            stats->rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+        static const std::string Busy =
+            "HTTP/1.1 503 Service Unavailable\r\n"
+            "Content-Length: 0\r\n"
+            "Retry-After: 1\r\n"
+            "Connection: Close\r\n\r\n";
+        async_write(*socket, buffer(Busy),
+            [this, socket](const boost::system::error_code&, size_t) {
+                boost::system::error_code ignored;
+                socket->shutdown(tcp::socket::shutdown_both, ignored);
+                closed();
+            });
+    }
+
+    // Account for a connection that has been closed.
+    void closed() {
+        --active;
+        metrics.add(Stat::ConnectionsActive, -1);
+        if (stats != nullptr) {
+            stats->active.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    io_service& service;
+    const ServerConfig config;
+    tcp::acceptor acceptor;
+    ListenerStats* const stats;
+    WorkerPool pool;
+    // Number of connections currently accepted but not yet closed.
+    std::atomic<size_t> active{0};
+};
+
+/**
+ * Runs the program as an event-driven server that listens to incoming
+ * connections.
+ *
+ * @param port The port number on which the server should listen.
+ * @param config The settings for the event loop and worker pool.
+ */
+void runAsyncServer(int port, const ServerConfig& config) {
+    io_service service;
+    AsyncServer server(service, port, config);
+    server.start();
+    std::cout << "Server is listening on " << port << " with "
+              << config.ioThreads << " I/O threads & " << config.workers
+              << " workers...\n";
+    // Run the event loop on the requested number of threads.
+    std::vector<std::thread> loops;
+    for (int i = 1; (i < config.ioThreads); i++) {
+        loops.emplace_back([&service] { service.run(); });
+    }
+    service.run();
+    for (auto& t : loops) {
+        t.join();
+    }
+}
+
+/** Set up the server configuration from a list of options.
+
+    Options are of the form "--name=value" (or just "--async") and are
+    separated by white space.  Unknown options are reported on
+    std::cerr and ignored.
+
+    \param[in] options The options, e.g., the value of the HW7_OPTIONS
+    environment variable.
+
+    \return The server configuration to be used.
+ */
+ServerConfig parseOptions(const std::string& options) {
+    ServerConfig config;
+    std::istringstream is(options);
+    for (std::string opt; (is >> opt);) {
+        const size_t eq       = opt.find('=');
+        const std::string key = opt.substr(0, eq);
+        const std::string val = (eq == std::string::npos) ? "" :
+                                opt.substr(eq + 1);
+        if (key == "--async") {
+            config.async = true;
+        } else if (key == "--shards") {
+            config.async  = true;
+            config.shards = std::max(1, std::stoi(val));
+        } else if (key == "--io-threads") {
+            config.ioThreads = std::max(1, std::stoi(val));
+        } else if (key == "--workers") {
+            config.workers = std::max(1, std::stoi(val));
+        } else if (key == "--max-connections") {
+            config.maxConnections = std::stoul(val);
+        } else if (key == "--queue-depth") {
+            config.queueDepth = std::stoul(val);
+        } else if (key == "--idle-timeout") {
+            config.idleTimeout = std::max(1, std::stoi(val));
+        } else if (key == "--max-requests") {
+            config.maxRequests = std::max(1, std::stoi(val));
+        } else if (key == "--cache-mb") {
+            config.cacheBytes = std::stoul(val) << 20;
+        } else if (key == "--cgi-max") {
+            config.cgiMaxRunning = std::stoul(val);
+        } else if (key == "--cgi-queue") {
+            config.cgiMaxWaiting = std::stoul(val);
+        } else if (key == "--sample-ms") {
+            config.sampleInterval = std::max(1, std::stoi(val));
+        } else if (key == "--max-samples") {
+            config.maxSamples = std::stoul(val);
+        } else if (key == "--cgi-wall") {
+            config.cgiWallLimit = std::max(0, std::stoi(val));
+        } else if (key == "--cgi-cpu") {
+            config.cgiCpuLimit = std::max(0, std::stoi(val));
+        } else if (key == "--cgi-mem-mb") {
+            config.cgiMemLimit = std::stoul(val) << 20;
+        } else if (key == "--cgi-as-mb") {
+            config.cgiAddressLimit = std::stoul(val) << 20;
+        } else if (key == "--spool-kb") {
+            config.spoolBytes = std::max(1ul, std::stoul(val)) << 10;
+        } else if (key == "--job-ttl") {
+            config.jobTtl = std::max(0, std::stoi(val));
+        } else if (key == "--max-jobs") {
+            config.maxJobs = std::max(1ul, std::stoul(val));
+        } else if (key == "--cache-cmds") {
+            // A comma-separated list of command[:seconds] entries.
+            std::istringstream list(val);
+            std::string entry;
+            while (std::getline(list, entry, ',')) {
+                const size_t colon = entry.find(':');
+                if (!entry.empty()) {
+                    config.cacheCmds[entry.substr(0, colon)] =
+                        (colon == std::string::npos) ? 0 :
+                        std::max(0, std::stoi(entry.substr(colon + 1)));
+                }
+            }
+        } else if (key == "--cache-ttl") {
+            config.cacheTtl = std::max(0, std::stoi(val));
+        } else if (key == "--gzip-level") {
+            config.compression.level = std::min(9, std::max(0,
+                                                            std::stoi(val)));
+        } else if (key == "--gzip-min") {
+            config.compression.minSize = std::stoul(val);
+        } else if (key == "--gzip-types") {
+            // A comma-separated list of mime types.
+            config.compression.types.clear();
+            std::istringstream list(val);
+            std::string type;
+            while (std::getline(list, type, ',')) {
+                config.compression.types.push_back(type);
+            }
+        } else if (key == "--chunk-kb") {
+            config.chunkSize = std::max(1ul, std::stoul(val)) << 10;
+        } else {
+            std::cerr << "Ignoring unknown option " << opt << std::endl;
+        }
+    }
+    return config;
+}
+
+// Named-constants to keep pipe code readable below
+const int READ = 0, WRITE = 1;
+
+// The default file to return for "/"
+const std::string RootFile = "index.html";
+
+/** An incremental parser for the request line and headers of an HTTP
+    request.
+
+    Data is fed to the parser as it is read from the client (in blocks
+    of any size, down to a single byte) and is stored in a fixed-size
+    buffer.  A small state
+    machine records where the method, target, version, and each header
+    name/value start and end, so the parts of the request are returned
+    as views into the buffer without any copying or memory allocation.
+    The request line and headers together may not exceed MaxHeadSize
+    bytes and at most MaxHeaders header lines are accepted.  Both "\r\n"
+    and a bare "\n" are accepted as line terminators.  The parts of the
+    request can be obtained only after the status is Complete.
+ */
+class RequestParser {
+public:
+    // Maximum size of the request line and headers together.
+    static const size_t MaxHeadSize = 8192;
+    // Maximum number of header lines in a request.
+    static const size_t MaxHeaders = 64;
+
+    // The outcome of feeding a byte to the parser.
+    enum Status { Incomplete, Complete, Malformed, TooLarge };
+
+    /** Add the next byte of the request to the parser.
+
+        \param[in] ch The next byte read from the client.
+
+        \return Incomplete if more data is needed, Complete once the
+        blank line ending the headers has been seen, or Malformed /
+        TooLarge if the request is invalid.  Once the parser has
+        finished, further bytes are ignored and the status is returned
+        unchanged.
+     */
+    Status feed(char ch) {
+        if (status != Incomplete) {
+            return status;
+        } else if ((len == 0) && ((ch == '\r') || (ch == '\n'))) {
+            return status;  // Ignore blank lines before a request.
+        } else if (len == MaxHeadSize) {
+            return status = TooLarge;
+        }
+        buf[len] = ch;
+        switch (state) {
+        case State::Method:
+            if ((ch == ' ') && (len > 0)) {
+                methodEnd = len;
+                state     = State::Target;
+            } else if (!isToken(ch)) {
+                status = Malformed;
+            }
+            break;
+        case State::Target:
+            if (ch == ' ') {
+                targetEnd = len;
+                state     = State::Version;
+            } else if ((static_cast<unsigned char>(ch) <= ' ') ||
+                       (ch == 0x7f)) {
+                // Control characters (but not bytes >= 0x80, e.g., of
+                // UTF-8 file names) are not allowed in the target.
+                status = Malformed;
+            }
+            break;
+        case State::Version:
+            if (ch == '\n') {
+                versionEnd = trimEnd(targetEnd + 1, len);
+                state      = State::LineStart;
+            }
+            break;
+        case State::LineStart:
+            if (ch == '\n') {
+                status = Complete;  // The blank line ending the headers.
+            } else if (ch == '\r') {
+                // Wait for the '\n'.
+            } else if (fieldCount == MaxHeaders) {
+                status = TooLarge;
+            } else if (!isToken(ch)) {
+                status = Malformed;
+            } else {
+                fields[fieldCount].nameStart = len;
+                state = State::Name;
+            }
+            break;
+        case State::Name:
+            if (ch == ':') {
+                fields[fieldCount].nameEnd    = len;
+                fields[fieldCount].valueStart = len + 1;
+                state = State::Value;
+            } else if (!isToken(ch)) {
+                status = Malformed;
+            }
+            break;
+        case State::Value:
+            if (ch == '\n') {
+                Field& field     = fields[fieldCount++];
+                field.valueStart = trimStart(field.valueStart, len);
+                field.valueEnd   = trimEnd(field.valueStart, len);
+                state = State::LineStart;
+            }
+            break;
+        }
+        len++;
+        return status;
+    }
+
+    /** Add a block of data to the parser.
+
+        Data is consumed only up to the end of the headers, so any
+        pipelined request (or request body) that follows is not used.
+
+        \param[in] data The data read from the client.
+
+        \param[in] size The number of bytes in data.
+
+        \return The number of bytes consumed.  Use status() to check
+        whether the headers are complete.
+     */
+    size_t feed(const char* data, size_t size) {
+        size_t used = 0;
+        while ((used < size) && (status == Incomplete)) {
+            if ((state == State::Value) || (state == State::Version)) {
+                // Copy the rest of the line in one step.
+                const size_t avail = std::min(size - used, MaxHeadSize - len);
+                const void* eol    = std::memchr(data + used, '\n', avail);
+                const size_t count = (eol == nullptr) ? avail :
+                    (static_cast<const char*>(eol) - (data + used));
+                std::memcpy(buf + len, data + used, count);
+                len  += count;
+                used += count;
+                if (used == size) {
+                    break;
+                }
+            }
+            feed(data[used++]);
+        }
+        return used;
+    }
+
+    /** Returns the result of parsing the data so far. */
+    Status getStatus() const {
+        return status;
+    }
+
+    /** Returns the request method, e.g., "GET". */
+    std::string_view method() const {
+        return view(0, methodEnd);
+    }
+
+    /** Returns the request target, e.g., "/cgi-bin/exec?cmd=ls". */
+    std::string_view target() const {
+        return view(methodEnd + 1, targetEnd);
+    }
+
+    /** Returns the protocol version, e.g., "HTTP/1.1". */
+    std::string_view version() const {
+        return view(targetEnd + 1, versionEnd);
+    }
+
+    /** Returns the value of the first header with the given name.
+
+        \param[in] name The header name.  Names are compared ignoring
+        case.
+
+        \return The value of the header, without surrounding spaces.
+        If the header is not present an empty view is returned.
+     */
+    std::string_view header(std::string_view name) const {
+        for (size_t i = 0; (i < fieldCount); i++) {
+            if (equalsIgnoreCase(headerName(i), name)) {
+                return headerValue(i);
+            }
+        }
+        return std::string_view();
+    }
+
+    /** Returns the number of header lines in the request. */
+    size_t headerCount() const {
+        return fieldCount;
+    }
+
+    /** Returns the name of the i'th header, as sent by the client. */
+    std::string_view headerName(size_t i) const {
+        return view(fields[i].nameStart, fields[i].nameEnd);
+    }
+
+    /** Returns the value of the i'th header, without surrounding
+        spaces. */
+    std::string_view headerValue(size_t i) const {
+        return view(fields[i].valueStart, fields[i].valueEnd);
+    }
+
+    /** Case insensitive comparison of two (ASCII) strings. */
+    static bool equalsIgnoreCase(std::string_view s1, std::string_view s2) {
+        const auto lower = [](char ch) {
+            return ((ch >= 'A') && (ch <= 'Z')) ? (ch - 'A' + 'a') : ch; };
+        return (s1.size() == s2.size()) &&
+            std::equal(s1.begin(), s1.end(), s2.begin(), [&](char c1, char c2) {
+                return lower(c1) == lower(c2); });
+    }
+
+private:
+    // The position of the parser in the request.
+    enum class State { Method, Target, Version, LineStart, Name, Value };
+
+    // Offsets of a header line's name and value in the buffer.
+    struct Field {
+        uint16_t nameStart, nameEnd, valueStart, valueEnd;
+    };
+
+    // Returns true for characters allowed in a method or header name.
+    static bool isToken(char ch) {
+        return std::isalnum(static_cast<unsigned char>(ch)) ||
+            ((ch != '\0') && (std::strchr("!#$%&'*+-.^_`|~", ch) != nullptr));
+    }
+
+    // Returns the first offset in [start, end) that is not a space.
+    uint16_t trimStart(size_t start, size_t end) const {
+        while ((start < end) && std::isspace(static_cast<unsigned char>(
+                                                 buf[start]))) {
+            start++;
+        }
+        return start;
+    }
+
+    // Returns the offset just after the last non-space in [start, end).
+    uint16_t trimEnd(size_t start, size_t end) const {
+        while ((end > start) && std::isspace(static_cast<unsigned char>(
+                                                 buf[end - 1]))) {
+            end--;
+        }
+        return end;
+    }
+
+    std::string_view view(size_t start, size_t end) const {
+        return std::string_view(buf + start, end - start);
+    }
+
+    State state = State::Method;
+    Status status = Incomplete;
+    // Number of bytes stored in buf.
+    size_t len = 0;
+    uint16_t methodEnd = 0, targetEnd = 0, versionEnd = 0;
+    Field fields[MaxHeaders];
+    size_t fieldCount = 0;
+    char buf[MaxHeadSize];
+};
+
+/** Decode a URL encoded string in a single pass.
+
+    Entities of the form %nn (where 'n' is a hexadecimal digit) are
+    converted to the corresponding byte and '+' is converted to a
+    space.  A '%' that is not followed by two hexadecimal digits is
+    copied unchanged.
+
+    \param[in] str The string to be decoded.
+
+    \param[out] out The decoded string.  The contents are replaced.
+ */
+void urlDecode(std::string_view str, std::string& out) {
+    const auto hexValue = [](char ch) {
+        return std::isdigit(static_cast<unsigned char>(ch)) ? (ch - '0') :
+            (std::tolower(static_cast<unsigned char>(ch)) - 'a' + 10);
+    };
+    out.clear();
+    out.reserve(str.size());
+    for (size_t i = 0; (i < str.size()); i++) {
+        if ((str[i] == '%') && (i + 2 < str.size()) &&
+            std::isxdigit(static_cast<unsigned char>(str[i + 1])) &&
+            std::isxdigit(static_cast<unsigned char>(str[i + 2]))) {
+            out += static_cast<char>(hexValue(str[i + 1]) * 16 +
+                                     hexValue(str[i + 2]));
+            i += 2;
+        } else {
+            out += (str[i] == '+') ? ' ' : str[i];
+        }
+    }
+}
+
+/** Returns the (still URL encoded) value of a query string parameter.
+
+    \param[in] query The query string, e.g., "cmd=ls&args=-l".
+
+    \param[in] name The name of the parameter to look for.
+
+    \return The value of the first parameter with the given name.  If
+    the parameter is not present an empty view is returned.
+ */
+std::string_view queryParam(std::string_view query, std::string_view name) {
+    while (!query.empty()) {
+        const size_t amp = query.find('&');
+        const std::string_view param = query.substr(0, amp);
+        if ((param.size() > name.size()) && (param[name.size()] == '=') &&
+            (param.compare(0, name.size(), name) == 0)) {
+            return param.substr(name.size() + 1);
+        }
+        query.remove_prefix((amp == std::string_view::npos) ? query.size() :
+                            amp + 1);
+    }
+    return std::string_view();
+}
+
+/** Returns true if a comma separated header value (such as that of the
+    Connection header) contains the given token, ignoring case.
+ */
+bool hasToken(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        const size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && std::isspace(static_cast<unsigned char>(
+                                                 item.front()))) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && std::isspace(static_cast<unsigned char>(
+                                                 item.back()))) {
+            item.remove_suffix(1);
+        }
+        if (RequestParser::equalsIgnoreCase(item, token)) {
+            return true;
+        }
+        value.remove_prefix((comma == std::string_view::npos) ? value.size() :
+                            comma + 1);
+    }
+    return false;
+}
+
+/** The content codings supported for responses. */
+enum class Encoding { Identity, Gzip, Deflate };
+
+/** Returns the content coding to be used for a response given the
+    Accept-Encoding header of the request.  Gzip is preferred over
+    deflate.  Codings with a quality value of 0 are not acceptable and
+    "*" stands for gzip.
+ */
+Encoding acceptedEncoding(std::string_view value) {
+    bool gzip = false, deflate = false;
+    while (!value.empty()) {
+        const size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        value.remove_prefix((comma == std::string_view::npos) ? value.size() :
+                            comma + 1);
+        // Split off the parameters (e.g., ";q=0.5") from the coding.
+        const size_t semi = item.find(';');
+        std::string_view params = (semi == std::string_view::npos) ?
+            std::string_view() : item.substr(semi + 1);
+        item = item.substr(0, semi);
+        while (!item.empty() && std::isspace(static_cast<unsigned char>(
+                                                 item.front()))) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && std::isspace(static_cast<unsigned char>(
+                                                 item.back()))) {
+            item.remove_suffix(1);
+        }
+        const size_t q = params.find("q=");
+        if (q != std::string_view::npos) {
+            // Acceptable unless the value is all zeros (e.g., "0.000").
+            params.remove_prefix(q + 2);
+            const size_t end = params.find_first_not_of("0.");
+            if ((end == std::string_view::npos) ||
+                !std::isdigit(static_cast<unsigned char>(params[end]))) {
+                continue;
+            }
+        }
+        if (RequestParser::equalsIgnoreCase(item, "gzip") ||
+            (item == "*")) {
+            gzip = true;
+        } else if (RequestParser::equalsIgnoreCase(item, "deflate")) {
+            deflate = true;
+        }
+    }
+    return gzip ? Encoding::Gzip : deflate ? Encoding::Deflate :
+        Encoding::Identity;
+}
+
+/** Returns the headers (each terminated by "\r\n") that describe
+    the content coding of a response.
+ */
+std::string encodingHeader(Encoding encoding) {
+    return (encoding == Encoding::Identity) ? "" :
+        std::string("Content-Encoding: ") +
+        ((encoding == Encoding::Gzip) ? "gzip" : "deflate") +
+        "\r\nVary: Accept-Encoding\r\n";
+}
+
+/** The parts of an HTTP request that are used by this server.
+
+    The views refer to the buffer in the parser and are valid only
+    while the request object exists.
+ */
+struct Request {
+    // The request line and headers.
+    RequestParser head;
+    // The path (or cgi-bin command) from the request line, without the
+    // leading '/' and without the query string.
+    std::string_view path;
+    // The query string (after the '?') from the request line.
+    std::string_view query;
+    // True if the client wants the connection to stay open.
+    bool keepAlive = false;
+    // Size of the request body (if any) that follows the headers.
+    size_t contentLength = 0;
+    // The entity tag from the If-None-Match header (if any).
+    std::string_view ifNoneMatch;
+    // The value of the Range header (if any).
+    std::string_view range;
+    // The value of the Accept-Encoding header (if any).
+    std::string_view acceptEncoding;
+};
+
+/** Access to the get area of any stream buffer.
+
+    The get area pointers are protected members of std::streambuf, but
+    pointers to them obtained via a derived class can be used with any
+    stream buffer.  This lets the request parser work directly on the
+    data buffered in the stream rather than copying it out byte by
+    byte.
+ */
+class StreamBufAccess : public std::streambuf {
+public:
+    // Returns the next character to be read.
+    static char* getPtr(std::streambuf& buf) {
+        return (buf.*(&StreamBufAccess::gptr))();
+    }
+
+    // Returns the end of the data buffered for reading.
+    static char* endPtr(std::streambuf& buf) {
+        return (buf.*(&StreamBufAccess::egptr))();
+    }
+
+    // Marks count buffered characters as read.
+    static void consume(std::streambuf& buf, size_t count) {
+        (buf.*(&StreamBufAccess::gbump))(static_cast<int>(count));
+    }
+};
+
+/** Read the request line and headers of an HTTP request.
+
+    The request is parsed (using RequestParser) directly from the data
+    buffered in the stream, consuming only the request line and
+    headers so that pipelined requests that follow remain in the
+    stream.  HTTP/1.1 connections are persistent
+    unless the client sends "Connection: close", while HTTP/1.0
+    connections are persistent only with "Connection: keep-alive".
+    Any request body is read and discarded so that the next pipelined
+    request can be read from the stream.
+
+    \param[in] is The input stream from where the request is read.
+
+    \param[out] req The request information extracted from the data.
+
+    \return This method returns 200 if a request was read, 0 if a
+    complete request could not be read (e.g., the client closed the
+    connection), or the HTTP status code to be reported for an invalid
+    request (400 or 431).
+ */
+int readRequest(std::istream& is, Request& req) {
+    std::streambuf& in = *is.rdbuf();
+    while (req.head.getStatus() == RequestParser::Incomplete) {
+        if (in.sgetc() == std::char_traits<char>::eof()) {
+            is.setstate(std::ios::eofbit);
+            return 0;
+        }
+        // Parse the data already read into the stream's buffer.
+        const char* data = StreamBufAccess::getPtr(in);
+        const size_t used = req.head.feed(data, StreamBufAccess::endPtr(in) -
+                                          data);
+        StreamBufAccess::consume(in, used);
+    }
+    const RequestParser::Status status = req.head.getStatus();
+    if (status == RequestParser::TooLarge) {
+        return 431;
+    }
+    std::string_view target = req.head.target();
+    if ((status == RequestParser::Malformed) || target.empty() ||
+        (target.front() != '/') ||
+        (req.head.version().compare(0, 5, "HTTP/") != 0)) {
+        return 400;
+    }
+    target.remove_prefix(1);
+    const size_t question = target.find('?');
+    req.path  = target.substr(0, question);
+    req.query = (question == std::string_view::npos) ? std::string_view() :
+                target.substr(question + 1);
+    if (req.path.empty()) {
+        req.path = RootFile;  // default root file
+    }
+    // Extract the headers that are used in a single pass.
+    std::string_view connection, length;
+    for (size_t i = 0; (i < req.head.headerCount()); i++) {
+        const std::string_view name = req.head.headerName(i);
+        if (RequestParser::equalsIgnoreCase(name, "Connection")) {
+            connection = req.head.headerValue(i);
+        } else if (RequestParser::equalsIgnoreCase(name, "Content-Length")) {
+            length = req.head.headerValue(i);
+        } else if (RequestParser::equalsIgnoreCase(name, "If-None-Match")) {
+            req.ifNoneMatch = req.head.headerValue(i);
+        } else if (RequestParser::equalsIgnoreCase(name, "Range")) {
+            req.range = req.head.headerValue(i);
+        } else if (RequestParser::equalsIgnoreCase(name,
+                                                   "Accept-Encoding")) {
+            req.acceptEncoding = req.head.headerValue(i);
+        }
+    }
+    req.keepAlive = hasToken(connection, "keep-alive") ||
+        ((req.head.version() == "HTTP/1.1") && !hasToken(connection, "close"));
+    if (!length.empty() &&
+        (std::from_chars(length.data(), length.data() + length.size(),
+                         req.contentLength).ec != std::errc())) {
+        return 400;
+    }
+    // Skip over the request body as this server does not use it.
+    is.ignore(req.contentLength);
+    return is.good() ? 200 : 0;
+}
+
+/** Returns the Connection header (including the terminating "\r\n")
+    to be sent with a response.
+
+    \param[in] keepAlive If true the connection is kept open for more
+    requests.
+ */
+std::string connectionHeader(bool keepAlive) {
+    return keepAlive ? "Connection: keep-alive\r\n" : "Connection: Close\r\n";
+}
+
+/** An output stream buffer that encodes data written to it using HTTP
+    chunked transfer encoding.
+
+    Data is accumulated up to the block size and then sent to the
+    underlying stream as a single chunk.  Flushing the stream (e.g.,
+    via std::flush) sends any pending data as a (smaller) chunk, which
+    is used to stream output as it is generated.  Bytes are passed
+    through unchanged, so binary data is handled correctly.  Call
+    finish() to send the terminating zero-length chunk.
+
+    Optionally the data is compressed (using zlib) as it is written,
+    in which case each block is compressed and the compressed data is
+    sent as chunks.  Flushing the stream then also flushes the
+    compressor so that streamed output still reaches the client right
+    away.
+ */
+class ChunkedStreamBuf : public std::streambuf {
+public:
+    /** Create a stream buffer that writes chunks to the given stream.
+
+        \param[out] os The stream to which the chunks are written.
+
+        \param[in] blockSize The maximum number of bytes in a chunk.
+
+        \param[in] encoding The content coding for the data.  The
+        corresponding Content-Encoding header (see encodingHeader) must
+        be sent by the caller.
+
+        \param[in] level The zlib compression level to be used.
+     */
+    ChunkedStreamBuf(std::ostream& os, size_t blockSize,
+                     Encoding encoding = Encoding::Identity,
+                     int level = Z_DEFAULT_COMPRESSION)
+        : os(os), block(blockSize) {
+        setp(block.data(), block.data() + block.size());
+        if (encoding != Encoding::Identity) {
+            zipper.reset(new z_stream());
+            // Window bits of 15 + 16 select the gzip format while 15
+            // selects the zlib format used for HTTP's "deflate".
+            deflateInit2(zipper.get(), level, Z_DEFLATED,
+                         (encoding == Encoding::Gzip) ? (15 + 16) : 15, 8,
+                         Z_DEFAULT_STRATEGY);
+            zipped.resize(blockSize);
+        }
+    }
+
+    ~ChunkedStreamBuf() {
+        if (zipper) {
+            deflateEnd(zipper.get());
+        }
+    }
+
+    /** Send any pending data followed by the last (empty) chunk. */
+    void finish() {
+        sendChunk(pbase(), pptr() - pbase());
+        setp(block.data(), block.data() + block.size());
+        if (zipper) {
+            compress(nullptr, 0, Z_FINISH);
+        }
+        os << "0\r\n\r\n";
+        os.flush();
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        sendChunk(pbase(), pptr() - pbase());
+        setp(block.data(), block.data() + block.size());
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return os.good() ? traits_type::not_eof(ch) : traits_type::eof();
+    }
+
+    std::streamsize xsputn(const char* data, std::streamsize n) override {
+        for (std::streamsize done = 0; (done < n);) {
+            const std::streamsize left = n - done;
+            if ((pptr() == pbase()) &&
+                (left >= static_cast<std::streamsize>(block.size()))) {
+                // Large write: send it as-is without copying to block.
+                sendChunk(data + done, left);
+                break;
+            }
+            const std::streamsize count = std::min<std::streamsize>(left,
+                                                        epptr() - pptr());
+            std::copy(data + done, data + done + count, pptr());
+            pbump(count);
+            done += count;
+            if (pptr() == epptr()) {
+                overflow(traits_type::eof());  // Send the full block.
+            }
+        }
+        return os.good() ? n : 0;
+    }
+
+    int sync() override {
+        sendChunk(pbase(), pptr() - pbase());
+        setp(block.data(), block.data() + block.size());
+        if (zipper && unflushed) {
+            compress(nullptr, 0, Z_SYNC_FLUSH);
+            unflushed = false;
+        }
+        os.flush();
+        return os.good() ? 0 : -1;
+    }
+
+private:
+    // Write (compressed, if needed) data as chunks to the underlying
+    // stream.
+    void sendChunk(const char* data, std::streamsize n) {
+        if (zipper) {
+            if (n > 0) {
+                compress(data, n, Z_NO_FLUSH);
+                unflushed = true;
+            }
+        } else {
+            writeChunk(data, n);
+        }
+    }
+
+    // Pass data through the compressor, sending the compressed data
+    // produced as chunks.
+    void compress(const char* data, std::streamsize n, int flush) {
+        zipper->next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zipper->avail_in = static_cast<uInt>(n);
+        do {
+            zipper->next_out  = reinterpret_cast<Bytef*>(zipped.data());
+            zipper->avail_out = static_cast<uInt>(zipped.size());
+            deflate(zipper.get(), flush);
+            writeChunk(zipped.data(), zipped.size() - zipper->avail_out);
+        } while (zipper->avail_out == 0);
+    }
+
+    // Write one chunk to the underlying stream. Empty chunks are
+    // skipped as they would end the response.
+    void writeChunk(const char* data, std::streamsize n) {
+        if (n > 0) {
+            os << std::hex << n << "\r\n";
+            os.write(data, n);
+            os << "\r\n";
+        }
+    }
+
+    std::ostream& os;
+    std::vector<char> block;
+    // The compressor and its output buffer (if data is compressed).
+    std::unique_ptr<z_stream> zipper;
+    std::vector<char> zipped;
+    // True if data was compressed since the compressor was flushed.
+    bool unflushed = false;
+};
+
+/** Helper method to send HTTP 404 message back to the client.
+
+    This method is called in cases where the specified file name is
+    invalid.  This method uses the specified path and sends a suitable
+    404 response back to client.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] path The file path that is invalid.
+
+    \param[in] keepAlive If true the connection is kept open.
+ */
+void send404(std::ostream& os, const std::string& path,
+             bool keepAlive = false) {
+    const std::string msg = "The following file was not found: " + path;
+    // Send a fixed message back to the client.
+    os << "HTTP/1.1 404 Not Found\r\n"
+       << "Content-Type: text/plain\r\n"
+       << "Transfer-Encoding: chunked\r\n"        
+       << connectionHeader(keepAlive) << "\r\n";
+    // Send the chunked data to client.
+    os << std::hex << msg.size() << "\r\n";
+    // Write the actual data for the line.
+    os << msg << "\r\n";
+    // Send trailer out to end stream to client.
+    os << "0\r\n\r\n";
+}
+
+/**
+ * Obtain the mime type of data based on file extension.
+ * 
+ * @param path The path from where the file extension is to be determined.
+ * 
+ * @return The mime type associated with the contents of the file.
+ */
+std::string getMimeType(const std::string& path) {
+    const size_t dotPos = path.rfind('.');
+    if (dotPos != std::string::npos) {
+        const std::string ext = path.substr(dotPos + 1);
+        if (ext == "html") {
+            return "text/html";
+        } else if (ext == "png") {
+            return "image/png";
+        } else if (ext == "jpg") {
+            return "image/jpeg";
+        } else if (ext == "css") {
+            return "text/css";
+        } else if (ext == "js") {
+            return "application/javascript";
+        }
+    }
+    // In all cases return default mime type.
+    return "text/plain";
+}
+
+/** Compress data in one go.
+
+    \param[in] data The data to be compressed.
+
+    \param[in] encoding The content coding (gzip or deflate) to use.
+
+    \param[in] level The zlib compression level to be used.
+
+    \return The compressed data.
+ */
+std::string compressData(const std::string& data, Encoding encoding,
+                         int level) {
+    z_stream zipper = {};
+    deflateInit2(&zipper, level, Z_DEFLATED,
+                 (encoding == Encoding::Gzip) ? (15 + 16) : 15, 8,
+                 Z_DEFAULT_STRATEGY);
+    // The bound does not include the (larger) gzip header and trailer.
+    std::string result(deflateBound(&zipper, data.size()) + 32, '\0');
+    zipper.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(
+                                                    data.data()));
+    zipper.avail_in  = data.size();
+    zipper.next_out  = reinterpret_cast<Bytef*>(&result[0]);
+    zipper.avail_out = result.size();
+    deflate(&zipper, Z_FINISH);
+    result.resize(zipper.total_out);
+    deflateEnd(&zipper);
+    return result;
+}
+
+/** A static file held in memory by StaticCache.
+
+    The entry has the complete response header (except for the
+    Connection header, which depends on the request) so that a cache
+    hit can be sent back to the client without any further work.
+ */
+struct CachedFile {
+    // Size and modification time (in ns) of the file when it was read.
+    off_t size;
+    int64_t mtime;
+    // Entity tag derived from the size and modification time.
+    std::string etag;
+    // Status line, Content-Type, Content-Length, and ETag headers.
+    std::string header;
+    // The contents of the file.
+    std::string body;
+    // A compressed copy of the file with its own ETag and header.
+    struct Encoded {
+        std::string etag, header, body;
+    };
+    // The compressed copies (with empty bodies if the file is not
+    // compressed).
+    Encoded gzip, deflate;
+
+    /** Returns the number of bytes of data held for the file. */
+    size_t memory() const {
+        return body.size() + gzip.body.size() + deflate.body.size();
+    }
+};
+
+using CachedFilePtr = std::shared_ptr<const CachedFile>;
+
+/** An LRU cache of static files bounded by the total size of the files.
+
+    Entries are revalidated (using stat) at most once per revalidation
+    interval and reloaded if the file's size or modification time has
+    changed.  Files larger than 1/8th of the capacity are not cached.
+    Compressed copies of suitable files are made when they are loaded
+    so that hot files are not compressed for each request.
+ */
+class StaticCache {
+public:
+    /** Change the maximum number of bytes of file data to cache. */
+    void setCapacity(size_t bytes) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        capacity = bytes;
+        evict();
+    }
+
+    /** Change which files are compressed when they are loaded. */
+    void setCompression(const CompressionConfig& config) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        compression = config;
+    }
+
+    /** Obtain a cached copy of a file, loading it if needed.
+
+        \param[in] path The path to the file.
+
+        \return The cached file or nullptr if the file does not exist
+        or is not suitable for caching.
+     */
+    CachedFilePtr get(const std::string& path) {
+        // How often a cached file is checked for changes.
+        const auto Revalidate = std::chrono::seconds(1);
+        const auto now = std::chrono::steady_clock::now();
+        size_t maxFileSize;
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            maxFileSize = capacity / 8;
+            auto entry = entries.find(path);
+            if ((entry != entries.end()) &&
+                (now - entry->second->checked < Revalidate)) {
+                // Fresh entry. Move to front of LRU list and return it.
+                lru.splice(lru.begin(), lru, entry->second);
+                return entry->second->file;
+            }
+        }
+        // Check the file for changes outside the lock.
+        struct stat info;
+        if ((stat(path.c_str(), &info) != 0) || !S_ISREG(info.st_mode) ||
+            (static_cast<size_t>(info.st_size) > maxFileSize)) {
+            erase(path);
+            return nullptr;
+        }
+        const int64_t mtime = info.st_mtim.tv_sec * 1000000000LL +
+                              info.st_mtim.tv_nsec;
+        std::unique_lock<std::mutex> lock(cacheMutex);
+        auto entry = entries.find(path);
+        if ((entry != entries.end()) &&
+            (entry->second->file->size  == info.st_size) &&
+            (entry->second->file->mtime == mtime)) {
+            // File is unchanged. Just note the time we checked it.
+            entry->second->checked = now;
+            lru.splice(lru.begin(), lru, entry->second);
+            return entry->second->file;
+        }
+        // Load (and compress) the file outside the lock.
+        const CompressionConfig zip = compression;
+        lock.unlock();
+        std::ifstream dataFile(path, std::ios::binary);
+        if (!dataFile.good()) {
+            return nullptr;
+        }
+        auto file   = std::make_shared<CachedFile>();
+        file->size  = info.st_size;
+        file->mtime = mtime;
+        file->body.assign(std::istreambuf_iterator<char>(dataFile),
+                          std::istreambuf_iterator<char>());
+        std::ostringstream tag;
+        tag << '"' << std::hex << file->body.size() << '-' << mtime << '"';
+        file->etag   = tag.str();
+        file->header = "HTTP/1.1 200 OK\r\nContent-Type: " +
+            getMimeType(path) + "\r\nContent-Length: " +
+            std::to_string(file->body.size()) +
+            "\r\nAccept-Ranges: bytes\r\nETag: " +
+            file->etag + "\r\n";
+        const std::string mimeType = getMimeType(path);
+        if (zip.allows(mimeType, file->body.size())) {
+            encode(*file, file->gzip, Encoding::Gzip, mimeType, zip.level);
+            encode(*file, file->deflate, Encoding::Deflate, mimeType,
+                   zip.level);
+        }
+        lock.lock();
+        return replace(path, file, now);
+    }
+
+private:
+    // A cached file in the LRU list.  The file itself is immutable (it
+    // may be in use by other threads) but the time it was last checked
+    // for changes is updated in place.
+    struct Entry {
+        std::string path;
+        CachedFilePtr file;
+        std::chrono::steady_clock::time_point checked;
+    };
+
+    // Make a compressed copy of a file (if it is smaller).
+    static void encode(const CachedFile& file, CachedFile::Encoded& copy,
+                       Encoding encoding, const std::string& mimeType,
+                       int level) {
+        std::string body = compressData(file.body, encoding, level);
+        if (body.size() >= file.body.size()) {
+            return;  // Not worth it.
+        }
+        // The ETag is different as the representation is different.
+        copy.etag = file.etag;
+        copy.etag.insert(copy.etag.size() - 1,
+                         (encoding == Encoding::Gzip) ? "-gz" : "-df");
+        copy.header = "HTTP/1.1 200 OK\r\nContent-Type: " + mimeType +
+            "\r\nContent-Length: " + std::to_string(body.size()) +
+            "\r\nETag: " + copy.etag + "\r\n" + encodingHeader(encoding);
+        copy.body = std::move(body);
+    }
+
+    // Add or replace the entry for a path. Caller must hold the lock.
+    CachedFilePtr replace(const std::string& path, CachedFilePtr file,
+                          std::chrono::steady_clock::time_point checked) {
+        auto entry = entries.find(path);
+        if (entry != entries.end()) {
+            used -= entry->second->file->memory();
+            lru.erase(entry->second);
+        }
+        lru.push_front({path, file, checked});
+        entries[path] = lru.begin();
+        used += file->memory();
+        evict();
+        return file;
+    }
+
+    // Remove the entry (if any) for a file that is no longer valid.
+    void erase(const std::string& path) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto entry = entries.find(path);
+        if (entry != entries.end()) {
+            used -= entry->second->file->memory();
+            lru.erase(entry->second);
+            entries.erase(entry);
+        }
+    }
+
+    // Drop least-recently used entries until the data fits within
+    // the capacity. Caller must hold the lock.
+    void evict() {
+        while ((used > capacity) && !lru.empty()) {
+            used -= lru.back().file->memory();
+            entries.erase(lru.back().path);
+            lru.pop_back();
+        }
+    }
+
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+    size_t capacity = 64 << 20;
+    size_t used = 0;
+    CompressionConfig compression;
+    std::mutex cacheMutex;
+};
+
+// The cache of static files shared by all connections (except those of
+// a sharded server).
+StaticCache staticFiles;
+
+// The cache of static files used by the calling thread.
+thread_local StaticCache* localFiles = &staticFiles;
+
+/**
+ * Runs the program as several event-driven servers (shards) listening
+ * on the same port.
+ *
+ * Each shard has its own acceptor (bound with SO_REUSEPORT so that the
+ * kernel spreads new connections across the shards), an io_service run
+ * by one thread, a worker pool, and a static file cache.  All threads
+ * of a shard are pinned to one CPU.  Hence nothing is locked across
+ * shards to serve a request, except for running CGI commands (which
+ * are limited across the whole server).  The worker, queue,
+ * connection, and cache limits are split evenly between the shards.
+ *
+ * @param port The port number on which the server should listen.
+ * @param config The settings for the whole server.
+ */
+void runShardedServer(int port, const ServerConfig& config) {
+    // The CPUs this process may run on, one for each shard in turn.
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; (cpu < CPU_SETSIZE); cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    const auto split = [&config](size_t total) {
+        return std::max<size_t>(1, (total + config.shards - 1) /
+                                config.shards);
+    };
+    ServerConfig shard    = config;
+    shard.ioThreads       = 1;
+    shard.workers         = split(config.workers);
+    shard.queueDepth      = split(config.queueDepth);
+    shard.maxConnections  = split(config.maxConnections);
+    shard.cacheBytes      = split(config.cacheBytes);
+    metrics.setListeners(config.shards);
+    std::vector<std::thread> shards;
+    for (int i = 0; (i < config.shards); i++) {
+        shards.emplace_back([i, port, &shard, &cpus] {
+            if (!cpus.empty()) {
+                cpu_set_t cpu;
+                CPU_ZERO(&cpu);
+                CPU_SET(cpus[i % cpus.size()], &cpu);
+                pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+            }
+            // The workers (created by the server) inherit the cache
+            // and CPU of this thread.
+            StaticCache files;
+            files.setCapacity(shard.cacheBytes);
+            files.setCompression(shard.compression);
+            localFiles = &files;
+            io_service service;
+            AsyncServer server(service, port, shard, &metrics.listener(i));
+            server.start();
+            service.run();
+        });
+    }
+    std::cout << "Server is listening on " << port << " with "
+              << config.shards << " shards of " << shard.workers
+              << " workers each...\n";
+    for (auto& t : shards) {
+        t.join();
+    }
+}
+
+/** Determine the part of a file requested via a Range header.
+
+    Only a single byte range of the form "bytes=first-last",
+    "bytes=first-", or "bytes=-suffixLength" is supported.  Other
+    (e.g., multi-part) ranges are ignored and the whole file is sent.
+
+    \param[in] range The value of the Range header (may be empty).
+
+    \param[in] size The size of the file in bytes.
+
+    \param[out] first The offset of the first byte to be sent.
+
+    \param[out] last The offset of the last byte to be sent.
+
+    \return The HTTP status code for the response, i.e., 200 (whole
+    file), 206 (part of the file), or 416 (range not satisfiable).
+ */
+int parseRange(std::string_view range, off_t size, off_t& first,
+               off_t& last) {
+    first = 0;
+    last  = size - 1;
+    const size_t dash = range.find('-');
+    if ((range.substr(0, 6) != "bytes=") || (dash == std::string::npos) ||
+        (range.find(',') != std::string::npos)) {
+        return 200;
+    }
+    const std::string_view from = range.substr(6, dash - 6);
+    const std::string_view to   = range.substr(dash + 1);
+    // Converts a string of digits to a number, returning false if the
+    // string is not a valid number.
+    const auto toNumber = [](std::string_view str, off_t& num) {
+        const auto res = std::from_chars(str.data(), str.data() + str.size(),
+                                         num);
+        return (res.ec == std::errc()) && (res.ptr == str.data() + str.size());
+    };
+    off_t firstNum = 0, lastNum = 0;
+    if ((from.empty() && to.empty()) ||
+        (!from.empty() && !toNumber(from, firstNum)) ||
+        (!to.empty() && !toNumber(to, lastNum))) {
+        return 200;  // Malformed ranges are ignored.
+    } else if (from.empty()) {
+        // Suffix range with the last N bytes of the file.
+        first = std::max<off_t>(0, size - lastNum);
+    } else {
+        first = firstNum;
+        if (!to.empty()) {
+            last = std::min<off_t>(last, lastNum);
+        }
+    }
+    return ((first > last) || (first >= size)) ? 416 : 206;
+}
+
+/** Send the header for a (possibly partial) response with a body of
+    known length.
+
+    \param[out] os The output stream to where the header is written.
+
+    \param[in] status The status code from parseRange.
+
+    \param[in] mimeType The type of data in the body.
+
+    \param[in] first The offset of the first byte to be sent.
+
+    \param[in] last The offset of the last byte to be sent.
+
+    \param[in] size The size of the whole file.
+
+    \param[in] keepAlive If true the connection is kept open.
+ */
+void sendRangeHeader(std::ostream& os, int status,
+                     const std::string& mimeType, off_t first, off_t last,
+                     off_t size, bool keepAlive) {
+    if (status == 416) {
+        os << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+           << "Content-Range: bytes */" << std::dec << size << "\r\n"
+           << "Content-Length: 0\r\n";
+    } else {
+        os << ((status == 206) ? "HTTP/1.1 206 Partial Content\r\n" :
+                                 "HTTP/1.1 200 OK\r\n")
+           << "Content-Type: " << mimeType << "\r\n"
+           << "Content-Length: " << std::dec << (last - first + 1) << "\r\n"
+           << "Accept-Ranges: bytes\r\n";
+        if (status == 206) {
+            os << "Content-Range: bytes " << first << '-' << last << '/'
+               << size << "\r\n";
+        }
+    }
+    os << connectionHeader(keepAlive) << "\r\n";
+}
+
+/** Send a large static file directly from the file to the socket.
+
+    The HTTP header is written through the output stream but the file
+    data bypasses the stream and is sent by the kernel using
+    sendfile(2), avoiding any user-space copies.  Range requests are
+    supported so that large downloads can be resumed.
+
+    \param[out] os The output stream associated with the socket.
+
+    \param[in] sockFd The native handle of the client socket.
+
+    \param[in] path The path to the file to be sent.
+
+    \param[in] req The request with the (optional) Range header.
+
+    \param[in] keepAlive If true the connection is kept open.
+
+    \return This method returns false if the path is not a regular file
+    that could be opened, in which case nothing is sent.
+ */
+bool sendLargeFile(std::ostream& os, int sockFd, const std::string& path,
+                   const Request& req, bool keepAlive) {
+    const int fileFd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if ((fileFd == -1) || (fstat(fileFd, &info) != 0) ||
+        !S_ISREG(info.st_mode)) {
+        if (fileFd != -1) {
+            close(fileFd);
+        }
+        return false;
+    }
+    off_t first, last;
+    const int status = parseRange(req.range, info.st_size, first, last);
+    sendRangeHeader(os, status, getMimeType(path), first, last,
+                    info.st_size, keepAlive);
+    os.flush();
+    off_t remaining = (status == 416) ? 0 : (last - first + 1);
+    while (os.good() && (remaining > 0)) {
+        const ssize_t sent = sendfile(sockFd, fileFd, &first, remaining);
+        if (sent > 0) {
+            remaining -= sent;
+            metrics.add(Stat::BytesSent, sent);
+        } else if ((sent == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+            // The socket is non-blocking. Wait for room to send more.
+            pollfd pfd = {sockFd, POLLOUT, 0};
+            if (poll(&pfd, 1, 30000) <= 0) {
+                break;
+            }
+        } else {
+            break;  // Client went away or file was truncated.
+        }
+    }
+    if (remaining > 0) {
+        // The response is incomplete; the connection cannot be reused.
+        os.setstate(std::ios::badbit);
+    }
+    close(fileFd);
+    return true;
+}
+
+/** Send a cached static file back to the client.
+
+    If the client already has the current version of the file (as
+    indicated by its If-None-Match header) then a 304 response without
+    a body is sent instead.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] file The cached file to be sent.
+
+    \param[in] path The path of the file (for its mime type).
+
+    \param[in] req The request with the If-None-Match, Range, and
+    Accept-Encoding headers (if any) sent by the client.
+
+    \param[in] keepAlive If true the connection is kept open.
+ */
+void sendCached(std::ostream& os, const CachedFile& file,
+                const std::string& path, const Request& req,
+                bool keepAlive) {
+    // Use a compressed copy if the client accepts it.  Ranges always
+    // refer to the uncompressed file.
+    const Encoding encoding = req.range.empty() ?
+        acceptedEncoding(req.acceptEncoding) : Encoding::Identity;
+    const CachedFile::Encoded* copy =
+        (encoding == Encoding::Gzip) ? &file.gzip :
+        (encoding == Encoding::Deflate) ? &file.deflate : nullptr;
+    if ((copy != nullptr) && !copy->body.empty()) {
+        if (!req.ifNoneMatch.empty() && (req.ifNoneMatch == copy->etag)) {
+            os << "HTTP/1.1 304 Not Modified\r\nETag: " << copy->etag
+               << "\r\nVary: Accept-Encoding\r\n"
+               << connectionHeader(keepAlive) << "\r\n";
+            return;
+        }
+        os << copy->header << connectionHeader(keepAlive) << "\r\n";
+        os.write(copy->body.data(), copy->body.size());
+        return;
+    }
+    if (!req.ifNoneMatch.empty() && (req.ifNoneMatch == file.etag)) {
+        os << "HTTP/1.1 304 Not Modified\r\nETag: " << file.etag << "\r\n"
+           << connectionHeader(keepAlive) << "\r\n";
+        return;
+    }
+    off_t first, last;
+    const int status = parseRange(req.range, file.size, first, last);
+    if (status != 200) {
+        // Partial requests are rare; build the header for this one.
+        sendRangeHeader(os, status, getMimeType(path), first, last,
+                        file.size, keepAlive);
+        if (status == 206) {
+            os.write(file.body.data() + first, last - first + 1);
+        }
+        return;
+    }
+    os << file.header << connectionHeader(keepAlive) << "\r\n";
+    os.write(file.body.data(), file.body.size());
+}
+
+/** Convenience method to split a given string into words.
+
+    This method is just a copy-paste of example code from lecture
+    slides.
+
+    \param[in] str The string to be split
+
+    \return A vector of words
+ */
+std::vector<std::string> split(std::string str) {
+    std::istringstream is(str);
+    std::string word;
+    std::vector<std::string> list;
+    while (is >> word) {
+        list.push_back(word);
+    }
+    return list;
+}
+
+/** Limits the number of CGI commands that run at the same time.
+
+    Requests beyond the limit wait (in arrival order) for a running
+    command to finish.  Once the configured number of requests are
+    already waiting, further requests are turned away so that a flood
+    of CGI requests degrades gracefully instead of starting an
+    unbounded number of processes.
+ */
+class CgiLimiter {
+public:
+    /** Change the limits on running and waiting commands. */
+    void setLimits(size_t maxRunning, size_t maxWaiting) {
+        std::lock_guard<std::mutex> lock(slotMutex);
+        this->maxRunning = std::max<size_t>(1, maxRunning);
+        this->maxWaiting = maxWaiting;
+        slotCond.notify_all();
+    }
+
+    /** Wait for a free slot to run a command.
+
+        \return This method returns false (without waiting) if too many
+        requests are already waiting.  Otherwise it returns true once a
+        slot is available, and release() must be called when done.
+     */
+    bool acquire() {
+        std::unique_lock<std::mutex> lock(slotMutex);
+        if ((running >= maxRunning) && (waiting >= maxWaiting)) {
+            return false;
+        }
+        // Take a ticket so that waiting requests are served in order.
+        const size_t ticket = nextTicket++;
+        waiting++;
+        slotCond.wait(lock, [this, ticket] {
+            return (ticket == nowServing) && (running < maxRunning); });
+        waiting--;
+        nowServing++;
+        running++;
+        slotCond.notify_all();
+        return true;
+    }
+
+    /** Obtain a free slot to run a command without waiting.
+
+        \return This method returns true if a slot was obtained (and
+        release() must be called when done).  It returns false if all
+        slots are in use or other requests are already waiting.
+     */
+    bool tryAcquire() {
+        std::lock_guard<std::mutex> lock(slotMutex);
+        if ((running >= maxRunning) || (waiting > 0)) {
+            return false;
+        }
+        running++;
+        return true;
+    }
+
+    /** Free the slot obtained via acquire() or tryAcquire(). */
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(slotMutex);
+            running--;
+        }
+        slotCond.notify_all();
+    }
+
+private:
+    size_t maxRunning = 16, maxWaiting = 64;
+    size_t running = 0, waiting = 0;
+    size_t nextTicket = 0, nowServing = 0;
+    std::mutex slotMutex;
+    std::condition_variable slotCond;
+};
+
+// The limits on CGI commands shared by all connections.
+CgiLimiter cgiSlots;
+
+/** A cache of complete responses to CGI commands.
+
+    Only commands listed (via --cache-cmds) as being safe to cache are
+    used with this class.  Entries are created for a key (made from the
+    command, its arguments, and the output format) by the first request
+    and the command is run only once for concurrent requests with the
+    same key: the other requests wait for the response of the first one
+    (single-flight).  Successful (200) responses are then kept until
+    their time to live expires.
+ */
+class CgiCache {
+public:
+    /** Obtain the cached response for a key, running the command if
+        needed.
+
+        \param[in] key The key for the response.
+
+        \param[in] ttl The seconds the response may be used for.
+
+        \param[in] run The method that runs the command and returns
+        the complete response.
+
+        \param[out] age The seconds since the response was generated.
+
+        \param[out] hit Set to true if the command was not run for
+        this request.
+
+        \return The complete response (status line, headers, and body).
+        If run throws, the exception is passed on to the caller and
+        any waiting requests get a 500 response.
+     */
+    std::shared_ptr<const std::string> get(const std::string& key, int ttl,
+                                           const std::function<std::string()>&
+                                           run, int& age, bool& hit) {
+        using namespace std::chrono;
+        const auto now = steady_clock::now();
+        std::unique_lock<std::mutex> lock(cacheMutex);
+        auto entry = entries.find(key);
+        if ((entry != entries.end()) && (!entry->second->ready ||
+                                         (entry->second->expires > now))) {
+            // Another request has run (or is running) the command.
+            EntryPtr found = entry->second;
+            cacheCond.wait(lock, [&found] { return found->ready; });
+            age = duration_cast<seconds>(steady_clock::now() -
+                                         found->created).count();
+            hit = true;
+            return found->response;
+        }
+        // Drop expired entries so the cache does not grow without bound.
+        for (auto it = entries.begin(); (it != entries.end());) {
+            if (it->second->ready && (it->second->expires <= now)) {
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        EntryPtr mine = std::make_shared<Entry>();
+        entries[key] = mine;
+        lock.unlock();
+        // Run the command without holding the lock.
+        std::shared_ptr<const std::string> response;
+        try {
+            response = std::make_shared<const std::string>(run());
+        } catch (...) {
+            // Do not leave the waiting (and later) requests blocked.
+            finish(key, mine, std::make_shared<const std::string>(
+                       "HTTP/1.1 500 Internal Server Error\r\n"
+                       "Content-Length: 0\r\n" + connectionHeader(true) +
+                       "\r\n"), ttl);
+            throw;
+        }
+        finish(key, mine, response, ttl);
+        age = 0;
+        hit = false;
+        return response;
+    }
+
+private:
+    // A response along with the times it was made and expires.
+    struct Entry {
+        bool ready = false;
+        std::shared_ptr<const std::string> response;
+        std::chrono::steady_clock::time_point created, expires;
+    };
+    using EntryPtr = std::shared_ptr<Entry>;
+
+    // Store the response in an entry and wake up the requests waiting
+    // for it.
+    void finish(const std::string& key, const EntryPtr& mine,
+                const std::shared_ptr<const std::string>& response,
+                int ttl) {
+        using namespace std::chrono;
+        std::unique_lock<std::mutex> lock(cacheMutex);
+        mine->response = response;
+        mine->created  = steady_clock::now();
+        mine->expires  = mine->created + seconds(ttl);
+        mine->ready    = true;
+        if (response->compare(0, 12, "HTTP/1.1 200") != 0) {
+            // Errors are passed to waiting requests but not kept.
+            auto current = entries.find(key);
+            if ((current != entries.end()) && (current->second == mine)) {
+                entries.erase(current);
+            }
+        }
+        lock.unlock();
+        cacheCond.notify_all();
+    }
+
+    std::unordered_map<std::string, EntryPtr> entries;
+    std::mutex cacheMutex;
+    std::condition_variable cacheCond;
+};
+
+// The cached responses to CGI commands.
+CgiCache cgiResults;
+
+/** Uses posix_spawnp to run the child process.
+
+    Unlike fork(), posix_spawn does not copy the page tables of this
+    (large, multi-threaded) server process; it uses vfork-style
+    process creation and then runs the command.  The child's standard
+    output and standard error are redirected to the given pipes and
+    no other file descriptors (such as client sockets) are inherited.
+    The child is made the leader of a new process group so that it
+    can be killed along with any processes it starts, and SIGPIPE
+    (ignored by this server) is reset to its default action.
+
+    \param[in] argList The list of command-line arguments.  The 1st
+    entry is assumed to the command to be executed.
+
+    \param[in] outFd The pipe to be used as the child's std::cout.
+
+    \param[in] errFd The pipe to be used as the child's std::cerr.
+
+    \return The pid of the child process.  On errors (e.g., command not
+    found), -1 is returned and errno is set.
+*/
+pid_t spawnChild(std::vector<std::string> argList, int outFd, int errFd) {
+    // Setup the command-line arguments for posix_spawnp.  The following
+    // code is a copy-paste from lecture slides.
+    std::vector<char*> args;
+    for (size_t i = 0; (i < argList.size()); i++) {
+        args.push_back(&argList[i][0]);
+    }
+    // nullptr is very important
+    args.push_back(nullptr);
+    // Tie/redirect std::cout and std::cerr of command to the pipes.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outFd, 1);
+    posix_spawn_file_actions_adddup2(&actions, errFd, 2);
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                             POSIX_SPAWN_SETSIGDEF);
+    pid_t pid = -1;
+    const int err = posix_spawnp(&pid, args[0], &actions, &attr,
+                                 &args[0], environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/** Apply the per-process CPU time and address space limits to a child.
+
+    The limits are inherited by any processes the child starts later.
+    The ChildMonitor enforces the CPU limit (along with the wall-clock
+    and memory limits) for the whole process tree, so this mainly stops
+    a single runaway process sooner.  The address space limit is only
+    set if requested (--cgi-as-mb).
+
+    \param[in] pid The process ID of the child.
+
+    \param[in] config The server settings with the CGI limits.
+ */
+void setChildLimits(pid_t pid, const ServerConfig& config) {
+    if (config.cgiCpuLimit > 0) {
+        // SIGXCPU at the soft limit and SIGKILL a second later.
+        const rlimit cpu = {rlim_t(config.cgiCpuLimit),
+                            rlim_t(config.cgiCpuLimit + 1)};
+        prlimit(pid, RLIMIT_CPU, &cpu, nullptr);
+    }
+    if (config.cgiAddressLimit > 0) {
+        const rlimit mem = {config.cgiAddressLimit, config.cgiAddressLimit};
+        prlimit(pid, RLIMIT_AS, &mem, nullptr);
+    }
+}
+
+/** Writes report text (HTML, chart data, and JSON) to a stream through
+    a fixed-size buffer.
+
+    Numbers are formatted directly into the buffer with std::to_chars,
+    so no temporary strings are created.  Whenever the buffer fills up
+    it is written to the stream; when the stream is a ChunkedStreamBuf
+    the report is therefore sent incrementally as it is generated.
+    The buffer is also written when the writer is flushed or
+    destroyed.
+ */
+class ReportWriter {
+public:
+    explicit ReportWriter(std::ostream& os) : os(os) {}
+
+    ~ReportWriter() {
+        flush();
+    }
+
+    /** Add text to the report. */
+    ReportWriter& operator<<(std::string_view text) {
+        while (!text.empty()) {
+            const size_t count = std::min(text.size(), room());
+            std::memcpy(buf + len, text.data(), count);
+            len += count;
+            text.remove_prefix(count);
+            if (len == sizeof(buf)) {
+                flush();
+            }
+        }
+        return *this;
+    }
+
+    /** Add a single character to the report. */
+    ReportWriter& operator<<(char ch) {
+        return *this << std::string_view(&ch, 1);
+    }
+
+    /** Add an integer to the report. */
+    ReportWriter& operator<<(uint64_t value) {
+        reserve(MaxNumber);
+        len = std::to_chars(buf + len, buf + sizeof(buf), value).ptr - buf;
+        return *this;
+    }
+
+    /** Add a number truncated (not rounded) to 2 decimal places, e.g.,
+        "1.50".  Zero is written as just "0".
+     */
+    ReportWriter& decimals(float number) {
+        const int hundredths = static_cast<int>(number * 100);
+        if (hundredths == 0) {
+            return *this << '0';
+        } else if (hundredths < 0) {
+            *this << '-';
+        }
+        const unsigned value = std::abs(hundredths);
+        reserve(MaxNumber);
+        char* pos = std::to_chars(buf + len, buf + sizeof(buf),
+                                  value / 100).ptr;
+        *pos++ = '.';
+        *pos++ = '0' + (value % 100) / 10;
+        *pos++ = '0' + value % 10;
+        len = pos - buf;
+        return *this;
+    }
+
+    /** Add text as the contents of a JSON string, i.e., with quotes,
+        backslashes, and control characters escaped.  Other bytes are
+        copied unchanged.
+     */
+    ReportWriter& jsonString(const char* data, size_t count) {
+        static const char Hex[] = "0123456789abcdef";
+        for (size_t i = 0; (i < count); i++) {
+            const unsigned char ch = data[i];
+            reserve(6);
+            if ((ch == '"') || (ch == '\\')) {
+                buf[len++] = '\\';
+                buf[len++] = ch;
+            } else if (ch == '\n') {
+                buf[len++] = '\\';
+                buf[len++] = 'n';
+            } else if (ch < 0x20) {
+                std::memcpy(buf + len, "\\u00", 4);
+                buf[len + 4] = Hex[ch >> 4];
+                buf[len + 5] = Hex[ch & 0xf];
+                len += 6;
+            } else {
+                buf[len++] = ch;
+            }
+        }
+        return *this;
+    }
+
+    /** Write the buffered text to the stream. */
+    void flush() {
+        if (len > 0) {
+            os.write(buf, len);
+            len = 0;
+        }
+    }
+
+private:
+    // Space needed for the longest formatted number.
+    static const size_t MaxNumber = 32;
+
+    // Returns the free space in the buffer.
+    size_t room() const {
+        return sizeof(buf) - len;
+    }
+
+    // Make room for count more characters.
+    void reserve(size_t count) {
+        if (room() < count) {
+            flush();
+        }
+    }
+
+    std::ostream& os;
+    size_t len = 0;
+    char buf[4096];
+};
+
+// Number of clock ticks per second used for CPU times in /proc files.
+const long ClockTicks = sysconf(_SC_CLK_TCK);
+
+// Size of a memory page (used to convert RSS to bytes).
+const long PageSize = sysconf(_SC_PAGESIZE);
+
+/** Resource usage at a given point in time of a process, or of a
+    process and all of its descendants, as read from the /proc/[pid]
+    files.  Values are kept as numbers and are converted to strings
+    only when the statistics are rendered.
+ */
+struct ProcSample {
+    // Seconds since the process was started when the sample was taken.
+    float elapsed = 0;
+    // User and system CPU time (in clock ticks), including the time of
+    // children that have already exited and been waited for.
+    uint64_t utime = 0, stime = 0;
+    // Resident set size (in pages) and virtual memory size (in bytes).
+    uint64_t rss = 0, vsize = 0;
+    // Number of threads and number of processes.
+    uint64_t threads = 0, processes = 0;
+    // Number of minor and major page faults.
+    uint64_t minflt = 0, majflt = 0;
+    // Bytes read from and written to storage.
+    uint64_t readBytes = 0, writeBytes = 0;
+    // Voluntary and involuntary context switches.
+    uint64_t ctxSwitches = 0;
+
+    /** Add the usage of another process to this sample. */
+    void add(const ProcSample& other) {
+        utime       += other.utime;
+        stime       += other.stime;
+        rss         += other.rss;
+        vsize       += other.vsize;
+        threads     += other.threads;
+        processes   += other.processes;
+        minflt      += other.minflt;
+        majflt      += other.majflt;
+        readBytes   += other.readBytes;
+        writeBytes  += other.writeBytes;
+        ctxSwitches += other.ctxSwitches;
+    }
+};
+
+/** A reader for the stat, io, and status files of a process in /proc.
+
+    The files are opened once and kept open.  Each sample re-reads
+    them with pread into a fixed buffer and parses the fields in
+    place, so sampling does not allocate any memory.  Fields in the
+    stat file are located from the last ')' so that command names
+    with spaces or parentheses are handled correctly.
+ */
+class ProcReader {
+public:
+    explicit ProcReader(pid_t pid) {
+        statFd   = openFile(pid, "stat");
+        ioFd     = openFile(pid, "io");
+        statusFd = openFile(pid, "status");
+    }
+
+    ~ProcReader() {
+        for (int fd : {statFd, ioFd, statusFd}) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+
+    ProcReader(const ProcReader&) = delete;
+    ProcReader& operator=(const ProcReader&) = delete;
+
+    /** Read the current statistics for the process.
+
+        \param[out] sample The sample into which fields are stored.
+        The elapsed time is not changed.
+
+        \return This method returns false if the process is gone.
+     */
+    bool read(ProcSample& sample) const {
+        char buf[4096];
+        ssize_t len = (statFd == -1) ? -1 : pread(statFd, buf, 1024, 0);
+        const char* end = buf + std::max<ssize_t>(len, 0);
+        const char* pos = static_cast<const char*>(
+            memrchr(buf, ')', std::max<ssize_t>(len, 0)));
+        if (pos == nullptr) {
+            return false;
+        }
+        // Fields after the command name start with field #3 (state).
+        uint64_t fields[25] = {};
+        pos += 2;
+        for (int field = 3; (field < 25) && (pos < end); field++) {
+            fields[field] = scanNumber(pos, end);
+            // Skip over the rest of the field (e.g., state or sign).
+            while ((pos < end) && (*pos++ != ' ')) {}
+        }
+        sample.minflt    = fields[10];
+        sample.majflt    = fields[12];
+        sample.utime     = fields[14] + fields[16];
+        sample.stime     = fields[15] + fields[17];
+        sample.threads   = fields[20];
+        sample.vsize     = fields[23];
+        sample.rss       = fields[24];
+        sample.processes = 1;
+        // I/O and context switches are optional (may need privileges).
+        len = (ioFd == -1) ? -1 : pread(ioFd, buf, sizeof(buf), 0);
+        sample.readBytes  = findValue(buf, len, "read_bytes:");
+        sample.writeBytes = findValue(buf, len, "\nwrite_bytes:");
+        len = (statusFd == -1) ? -1 : pread(statusFd, buf, sizeof(buf), 0);
+        sample.ctxSwitches = findValue(buf, len, "\nvoluntary_ctxt_switches:")
+            + findValue(buf, len, "nonvoluntary_ctxt_switches:");
+        return true;
+    }
+
+private:
+    // Open /proc/[pid]/[name] for reading.
+    static int openFile(pid_t pid, const char* name) {
+        char path[48];
+        snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+        return open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    // Parse a decimal number at pos, advancing pos past the digits.
+    static uint64_t scanNumber(const char*& pos, const char* end) {
+        uint64_t value = 0;
+        while ((pos < end) && (*pos >= '0') && (*pos <= '9')) {
+            value = value * 10 + (*pos++ - '0');
+        }
+        return value;
+    }
+
+    // Find the number following "key" in a "key: value" style file.
+    static uint64_t findValue(const char* buf, ssize_t len,
+                              const char* key) {
+        const size_t keyLen = strlen(key);
+        const char* pos = (len <= 0) ? nullptr : static_cast<const char*>(
+            memmem(buf, len, key, keyLen));
+        if (pos == nullptr) {
+            return 0;
+        }
+        const char* end = buf + len;
+        for (pos += keyLen; (pos < end) && ((*pos == ' ') || (*pos == '\t'));
+             pos++) {}
+        return scanNumber(pos, end);
+    }
+
+    int statFd, ioFd, statusFd;
+};
+
+/** Samples the combined resource usage of a process and all of its
+    descendants.
+
+    Descendants are discovered on each sample via the
+    /proc/[pid]/task/[tid]/children files, so workers started by a
+    command (e.g., "sh -c" or "make -j") are included.  The /proc
+    files of each process are kept open between samples.  CPU times
+    of descendants that already exited are included via the
+    cumulative child times of their (live) parents.
+ */
+class ProcTreeSampler {
+public:
+    explicit ProcTreeSampler(pid_t root) : root(root) {
+    }
+
+    /** Read the combined statistics for the process tree.
+
+        \param[out] total The sample with the sums for all processes.
+        The elapsed time is not changed.
+
+        \return This method returns false if the root process is gone.
+     */
+    bool read(ProcSample& total) {
+        generation++;
+        std::vector<pid_t> pending = {root};
+        while (!pending.empty()) {
+            const pid_t pid = pending.back();
+            pending.pop_back();
+            auto& proc = procs[pid];
+            if (!proc.reader) {
+                proc.reader.reset(new ProcReader(pid));
+            }
+            ProcSample sample;
+            if (!proc.reader->read(sample)) {
+                continue;  // Process exited since it was found.
+            }
+            proc.generation = generation;
+            total.add(sample);
+            findChildren(pid, pending);
+        }
+        // Close the files for processes that are gone.
+        for (auto it = procs.begin(); (it != procs.end());) {
+            it = (it->second.generation == generation) ? std::next(it) :
+                 procs.erase(it);
+        }
+        return (procs.find(root) != procs.end());
+    }
+
+    /** Close the /proc files of all processes (e.g., once the root
+        process has been reaped).  A later read opens them again.
+     */
+    void clear() {
+        procs.clear();
+    }
+
+private:
+    // A process in the tree along with the last sample it was seen in.
+    struct Proc {
+        std::unique_ptr<ProcReader> reader;
+        uint64_t generation = 0;
+    };
+
+    // Add the pids of the children of all threads of a process.
+    static void findChildren(pid_t pid, std::vector<pid_t>& children) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/task", pid);
+        DIR* dir = opendir(path);
+        if (dir == nullptr) {
+            return;
+        }
+        while (dirent* task = readdir(dir)) {
+            if (task->d_name[0] == '.') {
+                continue;
+            }
+            snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid,
+                     atoi(task->d_name));
+            std::ifstream list(path);
+            for (pid_t child; list >> child;) {
+                children.push_back(child);
+            }
+        }
+        closedir(dir);
+    }
+
+    const pid_t root;
+    uint64_t generation = 0;
+    std::unordered_map<pid_t, Proc> procs;
+};
+
+// Prints out html code used in the program to the (chunked) ostream
+std::ostream& HTTP(std::ostream& os) {
+    std::string text = 
+        "<html>\n"
+       "  <head>\n"
+       "    <script type='text/javascript' "
+       "src='https://www.gstatic.com/charts/loader.js'></script>\n"
+       "    <script type='text/javascript' src='/draw_chart.js'></script>\n"
+       "    <link rel='stylesheet' type='text/css' href='/mystyle.css'>\n"
+       "  </head>\n\n"
+       "  <body>\n"
+       "    <h3>Output from program</h3>\n"
+       "    <textarea style='width: 700px; height: 200px'>\n";
+    os << text;
+    return os;
+}
+
+// Writes the HTML code for the rows of the table using the samples
+// read from the proc files
+void tableGen(ReportWriter& out, const std::vector<ProcSample>& contents) {
+    for (const ProcSample& temp : contents) {
+        out << "       <tr><td>";
+        out.decimals(temp.elapsed) << "</td><td>";
+        out.decimals(float(temp.utime) / ClockTicks) << "</td><td>";
+        out.decimals(float(temp.stime) / ClockTicks) << "</td><td>"
+            << temp.vsize / 1000 << "</td><td>"
+            << temp.rss * PageSize / 1000 << "</td><td>"
+            << temp.processes << "</td><td>"
+            << temp.readBytes / 1000 << "</td><td>"
+            << temp.writeBytes / 1000 << "</td><td>"
+            << temp.ctxSwitches << "</td></tr>\n";
+    }
+}
+
+// Writes the JSON data for the Google chart using the data from the proc
+// files. CPU usage is the total user and system time of the process tree.
+void chartGen(ReportWriter& out, const std::vector<ProcSample>& tableData) {
+    for (size_t i = 0; i < tableData.size(); i++) {
+        const ProcSample& temp = tableData[i];
+        out << "          [";
+        out.decimals(temp.elapsed) << ", ";
+        out.decimals(float(temp.utime + temp.stime) / ClockTicks) << ", "
+            << temp.vsize / 1000
+            << ((i != tableData.size() - 1) ? "],\n" : "]\n");
+    }
+}
+
+// Ends the HTML region, adds the HTML for the table, along with JSON data for
+// the Google chart. Data is written to the (chunked) ostream as it is
+// generated.
+void printData(bool genChart, std::ostream& os,
+    const std::vector<ProcSample>& tableData, uint64_t peakRss) {
+    ReportWriter out(os);
+    out << "     </textarea>\n"
+        "     <h2>Runtime statistics</h2>\n     <table>\n"
+        "       <tr><th>Time (sec)</th><th>User time</th><th>System time"
+        "</th><th>Memory (KB)</th><th>RSS (KB)</th><th>Processes</th>"
+        "<th>Read (KB)</th><th>Written (KB)</th><th>Context switches"
+        "</th></tr>\n";
+    tableGen(out, tableData);
+    out << "     </table>\n"
+        "     <p>Peak RSS: " << peakRss * PageSize / 1000 << " KB</p>\n"
+        "     <div id='chart' style='width: 900px; height: 500px'></div>\n"
+        "  </body>\n" "  <script type='text/javascript'>\n"
+        "    function getChartData() {\n"
+        "      return google.visualization.arrayToDataTable(\n"
+        "        [\n          ['Time (sec)', 'CPU Usage', "
+        "'Memory Usage']" << (genChart ? ",\n" : "\n");
+    if (genChart) {
+        chartGen(out, tableData);
+    }
+    out << "        ]\n      );\n    }\n  </script>\n</html>\n";
+}
+
+/** A child process along with the runtime statistics gathered for it.
+
+    The statistics and exit status are updated by the ChildMonitor
+    thread and read by the thread serving the request, so access is
+    synchronized.
+ */
+class ChildJob {
+public:
+    /** Create a job for the given child process.
+
+        \param[in] pid The process ID of the child.  The child must be
+        the leader of its own process group.
+
+        \param[in] command The command line (for listing the job).
+
+        \param[in] peerFd The client socket (or -1).  The job is
+        cancelled if the client closes the connection.
+
+        \param[in] config The server settings with the number of
+        samples to be kept and the limits for the job.
+     */
+    ChildJob(pid_t pid, const std::string& command, int peerFd,
+             const ServerConfig& config) : pid(pid), id(++lastId),
+        command(command), peerFd(peerFd),
+        started(std::chrono::steady_clock::now()), tree(pid),
+        maxRows(std::max<size_t>(1, config.maxSamples)),
+        wallLimit(config.cgiWallLimit), cpuLimit(config.cgiCpuLimit),
+        memLimit(config.cgiMemLimit), spoolLimit(config.spoolBytes) {
+    }
+
+    ~ChildJob() {
+        if (eventFd != -1) {
+            close(eventFd);
+        }
+    }
+
+    /** A file descriptor that becomes readable whenever a new sample is
+        recorded or the child exits.  Read it to reset it.  The
+        descriptor is created on the first call, so jobs nobody waits
+        on (i.e., submitted jobs) do not hold one.
+     */
+    int getEventFd() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        if (eventFd == -1) {
+            eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        return eventFd;
+    }
+
+    /** The process ID of the child. */
+    pid_t getPid() const {
+        return pid;
+    }
+
+    /** The unique ID of this job. */
+    uint64_t getId() const {
+        return id;
+    }
+
+    /** The command line being run. */
+    const std::string& getCommand() const {
+        return command;
+    }
+
+    /** The client socket (or -1) for this job. */
+    int getPeerFd() const {
+        return peerFd;
+    }
+
+    /** Kill the child and all processes in its process group.
+
+        \param[in] why The reason reported for the termination.  Only
+        the first reason is kept.
+
+        \return This method returns false if the child had already
+        exited.
+     */
+    bool cancel(const char* why) {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        if (exited) {
+            return false;
+        }
+        if (reason == nullptr) {
+            reason = why;
+        }
+        // The group exists until the (unreaped) leader is waited for.
+        kill(-pid, SIGKILL);
+        return true;
+    }
+
+    /** The reason the job was terminated, or nullptr if it was not. */
+    const char* getTermination() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        return reason;
+    }
+
+    /** The most recent sample (all zeros if none was recorded yet). */
+    ProcSample lastSample() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        return rows.empty() ? ProcSample() : rows.back();
+    }
+
+    /** Record the current statistics for the child process. */
+    void sample() {
+        const std::chrono::duration<float> elapsed =
+            std::chrono::steady_clock::now() - started;
+        ProcSample row;
+        row.elapsed = elapsed.count();
+        if (tree.read(row)) {
+            {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                if (rows.size() == maxRows) {
+                    rows.pop_front();  // Keep only the recent samples.
+                }
+                rows.push_back(row);
+                sampleCount++;
+                peakRss = std::max(peakRss, row.rss);
+            }
+            notify();
+            checkLimits(row);
+        }
+    }
+
+    /** Note that the child has exited and been reaped.  The method
+        set via setOnExit (if any) is called.  Must be called from the
+        thread that samples the job, as the /proc files are closed.
+     */
+    void setExited(int status) {
+        tree.clear();
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            exitStatus = status;
+            exited     = true;
+            exitedAt   = std::chrono::steady_clock::now();
+        }
+        exitCond.notify_all();
+        notify();
+        if (onExit) {
+            onExit();
+        }
+    }
+
+    /** Set a method to be called (from the monitor thread) once the
+        child has exited.  Must be called before the job is watched.
+     */
+    void setOnExit(std::function<void()> method) {
+        onExit = std::move(method);
+    }
+
+    /** Check if the child exited more than the given time ago. */
+    bool exitedBefore(std::chrono::steady_clock::time_point when) {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        return exited && (exitedAt < when);
+    }
+
+    /** Add output of the child to the spool.  Only the most recent
+        output (up to the spool size) is kept.
+     */
+    void spoolOutput(const char* data, size_t count) {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        spool.append(data, count);
+        if (spool.size() > spoolLimit) {
+            // Drop the oldest output (at least half the spool at a time
+            // so that the copying is amortized).
+            const size_t drop = std::max(spool.size() - spoolLimit,
+                                         spoolLimit / 2);
+            spool.erase(0, std::min(drop, spool.size()));
+            spoolStart += drop;
+        }
+    }
+
+    /** Note that all output of the child has been spooled. */
+    void setSpoolDone() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        spoolDone = true;
+        spool.shrink_to_fit();  // Kept until the result expires.
+    }
+
+    /** Obtain spooled output.
+
+        \param[in] offset The offset (from the start of all output) of
+        the first byte wanted.
+
+        \param[out] data The output from the offset onwards.  If output
+        at the offset was already dropped from the spool, the data
+        starts with the oldest output still kept.
+
+        \param[out] start The offset of the first byte in data.
+
+        \return This method returns true if the child has exited and
+        all of its output has been spooled.
+     */
+    bool readSpool(uint64_t offset, std::string& data, uint64_t& start) {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        start = std::min(std::max(offset, spoolStart),
+                         spoolStart + spool.size());
+        data.assign(spool, start - spoolStart, std::string::npos);
+        return exited && spoolDone;
+    }
+
+    /** The exit status (as reported by waitpid) if the child has
+        exited, or -1 if it is still running.
+     */
+    int getExitStatus() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        return exited ? exitStatus : -1;
+    }
+
+    /** Check if the child has exited. */
+    bool hasExited() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        return exited;
+    }
+
+    /** Wait for the child to exit.
+
+        \return The exit status (as reported by waitpid) of the child.
+     */
+    int waitExit() {
+        std::unique_lock<std::mutex> lock(jobMutex);
+        exitCond.wait(lock, [this] { return exited; });
+        return exitStatus;
+    }
+
+    /** Obtain a copy of the recent statistics recorded so far. */
+    std::vector<ProcSample> samples() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        return std::vector<ProcSample>(rows.begin(), rows.end());
+    }
+
+    /** Obtain the samples recorded after a given point.
+
+        \param[in,out] seen The number of samples already obtained.
+        It is updated to the number of samples recorded so far.
+
+        \return The samples recorded since the previous call that are
+        still held by this job.
+     */
+    std::vector<ProcSample> samplesSince(uint64_t& seen) {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        const size_t count = std::min<uint64_t>(sampleCount - seen,
+                                                rows.size());
+        seen = sampleCount;
+        return std::vector<ProcSample>(rows.end() - count, rows.end());
+    }
+
+    /** The largest combined RSS (in pages) of the process tree. */
+    uint64_t getPeakRss() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        return peakRss;
+    }
+
+private:
+    // Cancel the job if the process tree has exceeded any limits.
+    void checkLimits(const ProcSample& row) {
+        if ((wallLimit > 0) && (row.elapsed > wallLimit)) {
+            cancel("wall time limit");
+        } else if ((cpuLimit > 0) && ((row.utime + row.stime) / ClockTicks >=
+                                      uint64_t(cpuLimit))) {
+            cancel("CPU time limit");
+        } else if ((memLimit > 0) && (row.rss * PageSize > memLimit)) {
+            cancel("memory limit");
+        }
+    }
+
+    // Wake up the thread (if any) waiting on the eventFd.
+    void notify() {
+        const uint64_t one = 1;
+        std::lock_guard<std::mutex> lock(jobMutex);
+        if ((eventFd != -1) &&
+            (write(eventFd, &one, sizeof(one)) != sizeof(one))) {
+            // Counter is already non-zero, i.e., reader has pending event.
+        }
+    }
+
+    // The ID given to the most recently created job.
+    static std::atomic<uint64_t> lastId;
+
+    const pid_t pid;
+    const uint64_t id;
+    const std::string command;
+    const int peerFd;
+    const std::chrono::steady_clock::time_point started;
+    ProcTreeSampler tree;
+    // A bounded ring of the most recent samples.
+    std::deque<ProcSample> rows;
+    const size_t maxRows;
+    // The total number of samples recorded (including dropped ones).
+    uint64_t sampleCount = 0;
+    // Created on demand by getEventFd (-1 until then).
+    int eventFd = -1;
+    uint64_t peakRss = 0;
+    bool exited = false;
+    int exitStatus = 0;
+    std::chrono::steady_clock::time_point exitedAt;
+    std::function<void()> onExit;
+    // The limits (0 for none) in seconds, CPU seconds, and bytes.
+    const int wallLimit, cpuLimit;
+    const size_t memLimit;
+    // The most recent output of a submitted job.  The spool holds the
+    // output from offset spoolStart onwards.
+    std::string spool;
+    const size_t spoolLimit;
+    uint64_t spoolStart = 0;
+    bool spoolDone = false;
+    // Why the job was cancelled (nullptr if it was not).
+    const char* reason = nullptr;
+    std::mutex jobMutex;
+    std::condition_variable exitCond;
+};
+
+std::atomic<uint64_t> ChildJob::lastId{0};
+
+using ChildJobPtr = std::shared_ptr<ChildJob>;
+
+/** The CGI jobs that are currently running, so that they can be listed
+    and cancelled via cgi-bin/jobs.
+ */
+class JobRegistry {
+public:
+    /** Add a job to the registry. */
+    void add(const ChildJobPtr& job) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        jobs[job->getId()] = job;
+    }
+
+    /** Remove a job (once it has finished) from the registry. */
+    void remove(uint64_t id) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        jobs.erase(id);
+    }
+
+    /** Find a job by its ID.  Returns nullptr if there is no such job. */
+    ChildJobPtr find(uint64_t id) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        const auto entry = jobs.find(id);
+        return (entry == jobs.end()) ? nullptr : entry->second;
+    }
+
+    /** Remove jobs that exited more than the given number of seconds
+        ago.
+     */
+    void collect(int ttl) {
+        const auto cutoff = std::chrono::steady_clock::now() -
+            std::chrono::seconds(ttl);
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (auto it = jobs.begin(); (it != jobs.end());) {
+            if (it->second->exitedBefore(cutoff)) {
+                it = jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /** Make room for another job by removing the oldest jobs that
+        have exited, if needed.
+
+        \param[in] maxJobs The maximum number of jobs kept.
+
+        \return This method returns false if the registry is full of
+        jobs that are still running.
+     */
+    bool makeRoom(size_t maxJobs) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto it = jobs.begin();
+        while ((jobs.size() >= maxJobs) && (it != jobs.end())) {
+            if (it->second->hasExited()) {
+                it = jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return (jobs.size() < maxJobs);
+    }
+
+    /** Obtain the jobs in the order they were started. */
+    std::vector<ChildJobPtr> list() {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        std::vector<ChildJobPtr> result;
+        for (const auto& entry : jobs) {
+            result.push_back(entry.second);
+        }
+        return result;
+    }
+
+private:
+    std::map<uint64_t, ChildJobPtr> jobs;
+    std::mutex registryMutex;
+};
+
+// The CGI jobs run by this server.
+JobRegistry runningJobs;
+
+// The jobs started via cgi-bin/submit, kept until their results expire.
+JobRegistry submittedJobs;
+
+/** A single thread that monitors all running child processes.
+
+    Exits are detected via a pidfd for each child (registered with
+    epoll), so the child is reaped as soon as it finishes and the
+    thread waiting on the job is woken up immediately.  A timerfd
+    ticks at the sampling interval and on each tick the statistics
+    of all live children are recorded.  If pidfds are not supported
+    by the kernel, children are checked for exit on each tick
+    instead.
+ */
+class ChildMonitor {
+public:
+    /** Change the sampling interval (in milliseconds). */
+    void setInterval(int millis) {
+        std::lock_guard<std::mutex> lock(monitorMutex);
+        interval = std::max(1, millis);
+        if (timerFd != -1) {
+            armTimer();
+        }
+    }
+
+    /** Start monitoring a child process.
+
+        \param[in] job The job for the child.  ChildJob::setExited is
+        called once the child has been reaped.
+     */
+    void watch(ChildJobPtr job) {
+        std::call_once(started, [this] { start(); });
+        const int pidFd = syscall(SYS_pidfd_open, job->getPid(), 0);
+        std::lock_guard<std::mutex> lock(monitorMutex);
+        jobs[job->getPid()] = Watched{job, pidFd};
+        if (pidFd != -1) {
+            epoll_event event = {};
+            event.events   = EPOLLIN;
+            event.data.u64 = static_cast<uint64_t>(job->getPid());
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, pidFd, &event);
+        }
+    }
+
+    /** Spool the output of a child process in its job.
+
+        \param[in] job The job whose output is to be spooled.
+        ChildJob::setSpoolDone is called once both pipes are closed.
+
+        \param[in] outFd, errFd The read ends of the pipes for the
+        child's standard output and error.  They are closed by the
+        monitor.
+     */
+    void watchOutput(ChildJobPtr job, int outFd, int errFd) {
+        std::call_once(started, [this] { start(); });
+        std::lock_guard<std::mutex> lock(monitorMutex);
+        openPipes[job.get()] = 2;
+        for (const int fd : {outFd, errFd}) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            pipes[fd] = job;
+            epoll_event event = {};
+            event.events   = EPOLLIN;
+            event.data.u64 = PipeTag | static_cast<uint64_t>(fd);
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        }
+    }
+
+private:
+    // A child being monitored along with its pidfd (or -1).
+    struct Watched {
+        ChildJobPtr job;
+        int pidFd;
+    };
+
+    // Read available output from a pipe into its job's spool, closing
+    // the pipe at end of output.  Caller must hold the lock.
+    void drain(int fd) {
+        auto entry = pipes.find(fd);
+        if (entry == pipes.end()) {
+            return;
+        }
+        char buffer[16384];
+        ssize_t count;
+        while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+            entry->second->spoolOutput(buffer, count);
+        }
+        if ((count == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+            return;  // More output to come.
+        }
+        close(fd);  // Also removes it from epoll
+        ChildJobPtr job = std::move(entry->second);
+        pipes.erase(entry);
+        if (--openPipes[job.get()] == 0) {
+            openPipes.erase(job.get());
+            job->setSpoolDone();
+        }
+    }
+
+    // Set up the epoll instance and timer and start the thread.
+    void start() {
+        std::lock_guard<std::mutex> lock(monitorMutex);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        armTimer();
+        epoll_event event = {};
+        event.events   = EPOLLIN;
+        event.data.u64 = TimerTag;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+        std::thread(&ChildMonitor::run, this).detach();
+    }
+
+    // Set the timer to tick at the interval. Caller must hold lock.
+    void armTimer() {
+        itimerspec spec = {};
+        spec.it_interval.tv_sec  = interval / 1000;
+        spec.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(timerFd, 0, &spec, nullptr);
+    }
+
+    // Reap a child (if it has exited) and notify its job.
+    // Caller must hold the lock.
+    void reap(pid_t pid, bool wait) {
+        auto entry = jobs.find(pid);
+        int status = 0;
+        if ((entry == jobs.end()) ||
+            (waitpid(pid, &status, wait ? 0 : WNOHANG) != pid)) {
+            return;
+        }
+        entry->second.job->setExited(status);
+        if (entry->second.pidFd != -1) {
+            close(entry->second.pidFd);  // Also removes it from epoll
+        }
+        jobs.erase(entry);
+    }
+
+    // The main method for the monitoring thread.
+    void run() {
+        epoll_event events[64];
+        while (true) {
+            const int count = epoll_wait(epollFd, events, 64, -1);
+            bool tick = false;
+            std::lock_guard<std::mutex> lock(monitorMutex);
+            // Process exits first so that zombies are not sampled.
+            for (int i = 0; (i < count); i++) {
+                if (events[i].data.u64 == TimerTag) {
+                    uint64_t expirations;
+                    tick = (read(timerFd, &expirations, 8) == 8);
+                } else if (events[i].data.u64 & PipeTag) {
+                    drain(static_cast<int>(events[i].data.u64 & 0xffffffff));
+                } else {
+                    reap(static_cast<pid_t>(events[i].data.u64), true);
+                }
+            }
+            if (!tick) {
+                continue;
+            }
+            for (auto it = jobs.begin(); (it != jobs.end());) {
+                const pid_t pid = (it++)->first;
+                if (jobs[pid].pidFd == -1) {
+                    reap(pid, false);  // No pidfd. Check for exit.
+                }
+            }
+            for (auto& entry : jobs) {
+                entry.second.job->sample();
+            }
+        }
+    }
+
+    // The epoll data value used for the timer (pids are never 0).
+    static const uint64_t TimerTag = 0;
+    // The bit set in epoll data values for spooled pipes.
+    static const uint64_t PipeTag = 1ull << 32;
+
+    std::unordered_map<pid_t, Watched> jobs;
+    // The jobs whose output is being spooled, keyed by pipe, along with
+    // the number of pipes still open for each job.
+    std::unordered_map<int, ChildJobPtr> pipes;
+    std::unordered_map<ChildJob*, int> openPipes;
+    int interval = 1000;
+    int epollFd = -1, timerFd = -1;
+    std::once_flag started;
+    std::mutex monitorMutex;
+};
+
+// The monitor for all child processes started by this server.
+ChildMonitor childMonitor;
+
+/** Helper method to send the data to client in chunks.
+    
+    This method is a helper method that is used to send data to the
+    client using chunked transfer encoding.  Data is copied as-is (so
+    binary files are sent correctly) in blocks of up to the configured
+    chunk size, compressed if an encoding is given.
+
+*/
+void sendMoreData(const std::string& mimeType, std::istream& is,
+                  std::ostream& os, bool keepAlive,
+                  const ServerConfig& config,
+                  Encoding encoding = Encoding::Identity) {
+    // First write the fixed HTTP header.
+    os << "HTTP/1.1 200 OK\r\n"
+       << "Content-Type: " << mimeType << "\r\n"        
+       << "Transfer-Encoding: chunked\r\n" << encodingHeader(encoding)
+       << connectionHeader(keepAlive) << "\r\n";
+    // Copy data from the file and write results to client.
+    ChunkedStreamBuf chunked(os, config.chunkSize, encoding,
+                             config.compression.level);
+    std::ostream out(&chunked);
+    out << is.rdbuf();
+    out.flush();
+    chunked.finish();
+}
+
+/** Read the output of a child process as it is generated.
+
+    Standard output and standard error of the child are read as data
+    becomes available on either pipe and passed to the onOutput
+    callback.  The job's event file descriptor is monitored as well
+    and onEvent is called whenever it becomes readable.  If the client
+    connection fails (hang up or error, e.g., a reset) or onOutput
+    reports that the client can no longer be written to, the job is
+    cancelled.  A client that has only shut down its sending side is
+    still waiting for the response, so that alone does not count.
+    This method returns once both pipes are closed or the job is
+    cancelled.
+
+    \param[in] job The child process whose output is read.
+
+    \param[in] outFd The read-end of the child's std::cout pipe.
+
+    \param[in] errFd The read-end of the child's std::cerr pipe.
+
+    \param[in] bufSize The size of the buffer used for reading.
+
+    \param[in] onOutput The method called with each block of output.
+    It returns false if the output could not be sent.
+
+    \param[in] onEvent The method called when the job's event file
+    descriptor is readable.
+ */
+void readChildOutput(ChildJob& job, int outFd, int errFd, size_t bufSize,
+    const std::function<bool(const char*, size_t)>& onOutput,
+    const std::function<void()>& onEvent = [] {}) {
+    std::vector<char> buf(bufSize);
+    // Only errors (POLLHUP and POLLERR, which are always reported) are
+    // of interest on the client socket; any data the client sends
+    // (e.g., a pipelined request) and a half-close are left alone.
+    pollfd fds[4] = {{outFd, POLLIN, 0}, {errFd, POLLIN, 0},
+                     {job.getEventFd(), POLLIN, 0},
+                     {job.getPeerFd(), 0, 0}};
+    while ((fds[0].fd != -1) || (fds[1].fd != -1)) {
+        if ((poll(fds, 4, -1) == -1) && (errno != EINTR)) {
+            break;
+        }
+        if (fds[3].revents & (POLLHUP | POLLERR)) {
+            job.cancel("client closed connection");
+            return;
+        }
+        for (int i = 0; (i < 2); i++) {
+            if ((fds[i].fd == -1) || (fds[i].revents == 0)) {
+                continue;
+            }
+            const ssize_t count = read(fds[i].fd, buf.data(), buf.size());
+            if ((count > 0) && !onOutput(buf.data(), count)) {
+                job.cancel("client closed connection");
+                return;
+            } else if ((count == 0) || ((count < 0) && (errno != EINTR))) {
+                fds[i].fd = -1;  // Pipe closed; ignored by poll from now.
+            }
+        }
+        if (fds[2].revents != 0) {
+            uint64_t events;
+            if (read(fds[2].fd, &events, sizeof(events)) == sizeof(events)) {
+                onEvent();
+            }
+        }
+    }
+}
+
+/** Copy the output of a child process to the client as it is
+    generated.
+
+    \param[in] job The child process whose output is copied.
+
+    \param[in] outFd The read-end of the child's std::cout pipe.
+
+    \param[in] errFd The read-end of the child's std::cerr pipe.
 
-// shared_ptr is a garbage collected pointer!
-using TcpStreamPtr = std::shared_ptr<tcp::iostream>;
+    \param[out] out The (chunked) stream to where output is written.
 
-/** Simple method to be run from a separate thread.
- *
- * @param client The client socket to be processed.
+    \param[in] bufSize The size of the buffer used for reading.
  */
-void threadMain(TcpStreamPtr client) {
-    // Call routine/regular helper method.
-    serveClient(*client, *client, true);
+void copyChildOutput(ChildJob& job, int outFd, int errFd, std::ostream& out,
+                     size_t bufSize) {
+    readChildOutput(job, outFd, errFd, bufSize,
+        [&out](const char* data, size_t count) {
+            out.write(data, count);
+            out.flush();  // Send child's output right away
+            return out.good();
+        });
 }
 
-/**
- * Runs the program as a server that listens to incoming connections.
- * 
- * @param port The port number on which the server should listen.
+/** Write a sample as a JSON object for use by scripts.
+
+    \param[out] out The writer to which the JSON is written.
+
+    \param[in] sample The sample to be converted.  The JSON object is
+    on a single line and has the times in seconds and sizes in KB.
  */
-void runServer(int port) {
-    // Setup a server socket to accept connections on the socket
-    io_service service;
-    // Create end point
-    tcp::endpoint myEndpoint(tcp::v4(), port);
-    // Create a socket that accepts connections
-    tcp::acceptor server(service, myEndpoint);
-    std::cout << "Server is listening on " << port 
-              << " & ready to process clients...\n";
-    // Process client connections one-by-one...forever
-    while (true) {
-        // Create garbage-collect object on heap
-        TcpStreamPtr client = std::make_shared<tcp::iostream>();
-        // Wait for a client to connect
-        server.accept(*client->rdbuf());
-        // Create a separate thread to process the client.
-        std::thread thr(threadMain, client);
-        thr.detach();
-    }
+void sampleJson(ReportWriter& out, const ProcSample& sample) {
+    out << "{\"time\": ";
+    out.decimals(sample.elapsed) << ", \"utime\": ";
+    out.decimals(float(sample.utime) / ClockTicks) << ", \"stime\": ";
+    out.decimals(float(sample.stime) / ClockTicks)
+        << ", \"vsize\": " << sample.vsize / 1000
+        << ", \"rss\": " << sample.rss * PageSize / 1000
+        << ", \"processes\": " << sample.processes
+        << ", \"read\": " << sample.readBytes / 1000
+        << ", \"written\": " << sample.writeBytes / 1000
+        << ", \"switches\": " << sample.ctxSwitches << '}';
+}
+
+/** Returns the exit code reported to clients for an exit status (as
+    reported by waitpid): the value passed to exit, or the negated
+    signal number if the process was killed by a signal.
+ */
+int decodeExitStatus(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
 }
 
-// Forward declaration for method used further below.
-std::string url_decode(std::string);
+/** Returns the reason a job was terminated as a JSON value, i.e., a
+    string or null if the job was not terminated.
+ */
+std::string terminationJson(ChildJob& job) {
+    const char* reason = job.getTermination();
+    return (reason == nullptr) ? "null" : ("\"" + std::string(reason) + "\"");
+}
 
-// Named-constants to keep pipe code readable below
-const int READ = 0, WRITE = 1;
+/** Stream the output and runtime statistics of a child process to the
+    client as Server-Sent Events (SSE).
 
-// The default file to return for "/"
-const std::string RootFile = "index.html";
+    Each line of output is sent as an "output" event and each sample
+    of statistics as a "sample" event (with JSON data) as soon as they
+    are available.  A final "exit" event has the exit code.  Nothing is
+    buffered beyond the current partial line of output.
 
-/**
- * This method is a convenience method that extracts file or command
- * from a string of the form: "GET <path> HTTP/1.1"
- * 
- * @param req The request from which the file path is to be extracted.
- * @return The path to the file requested
+    \param[in] job The child process whose output is to be sent.
+
+    \param[in] outFd The read-end of the child's std::cout pipe.
+
+    \param[in] errFd The read-end of the child's std::cerr pipe.
+
+    \param[out] os The output stream to the client.
+
+    \param[in] keepAlive If true the connection is kept open.
+
+    \param[in] encoding The content coding for the response.
+
+    \param[in] timing Extra headers with the queue and spawn times.
+
+    \param[in] config The server settings.
  */
-std::string getFilePath(const std::string& req) {
-    // std::cout << req << std::endl;
-    size_t spc1 = req.find(' '), spc2 = req.rfind(' ');
-    if ((spc1 == std::string::npos) || (spc2 == std::string::npos)) {
-        return "";  // Invalid or unhandled type of request.
-    }
-    std::string path = req.substr(spc1 + 2, spc2 - spc1 - 2);
-    if (path == "") {
-        return RootFile;  // default root file
+void streamChildOutput(ChildJob& job, int outFd, int errFd,
+        std::ostream& os, bool keepAlive, Encoding encoding,
+        const std::string& timing, const ServerConfig& config) {
+    os << "HTTP/1.1 200 OK\r\n"
+       << "Content-Type: text/event-stream\r\n"
+       << "Cache-Control: no-cache\r\n"
+       << "Transfer-Encoding: chunked\r\n" << encodingHeader(encoding)
+       << timing << connectionHeader(keepAlive) << "\r\n";
+    ChunkedStreamBuf chunked(os, config.chunkSize, encoding,
+                             config.compression.level);
+    std::ostream out(&chunked);
+    // Send each complete line of output as an event.  Lines end with
+    // "\n", "\r\n", or a bare "\r" (as in progress bars), just as
+    // for the client's event stream parser.
+    std::string partial;
+    const auto sendLines = [&out, &partial](const char* data, size_t count) {
+        partial.append(data, count);
+        size_t start = 0;
+        for (size_t end; (end = partial.find_first_of("\r\n", start)) !=
+                 std::string::npos;) {
+            if ((partial[end] == '\r') && (end + 1 == partial.size())) {
+                break;  // Could be the start of a "\r\n".
+            }
+            out << "event: output\ndata: ";
+            out.write(partial.data() + start, end - start);
+            out << "\n\n";
+            start = end + (((partial[end] == '\r') &&
+                            (partial[end + 1] == '\n')) ? 2 : 1);
+        }
+        partial.erase(0, start);
+    };
+    // Send any new samples as events.
+    uint64_t seen = 0;
+    const auto sendSamples = [&out, &job, &seen] {
+        ReportWriter writer(out);
+        for (const ProcSample& sample : job.samplesSince(seen)) {
+            writer << "event: sample\ndata: ";
+            sampleJson(writer, sample);
+            writer << "\n\n";
+        }
+    };
+    out << "retry: 60000\n\n" << std::flush;
+    readChildOutput(job, outFd, errFd, config.chunkSize,
+        [&](const char* data, size_t count) {
+            sendLines(data, count);
+            return out.flush().good();
+        },
+        [&] {
+            sendSamples();
+            out.flush();
+        });
+    if (!partial.empty()) {
+        sendLines("\n", 1);  // Last line did not end with a newline.
     }
-    return path;
+    // Wait for the monitor to reap the process and get exit code.
+    const int exitCode = decodeExitStatus(job.waitExit());
+    sendSamples();
+    out << "event: exit\ndata: {\"exitCode\": " << std::dec << exitCode
+        << ", \"terminated\": " << terminationJson(job) << "}\n\n";
+    out.flush();
+    chunked.finish();
 }
 
-/** Helper method to send HTTP 404 message back to the client.
+/** Send the output and runtime statistics of a child process to the
+    client.
 
-    This method is called in cases where the specified file name is
-    invalid.  This method uses the specified path and sends a suitable
-    404 response back to client.
+    \param[in] job The child process whose output is to be sent.
 
-    \param[out] os The output stream to where the data is to be
-    written.
+    \param[in] outFd The read-end of the child's std::cout pipe.
 
-    \param[in] path The file path that is invalid.
- */
-void send404(std::ostream& os, const std::string& path) {
-    const std::string msg = "The following file was not found: " + path;
-    // Send a fixed message back to the client.
-    os << "HTTP/1.1 404 Not Found\r\n"
-       << "Content-Type: text/plain\r\n"
-       << "Transfer-Encoding: chunked\r\n"        
-       << "Connection: Close\r\n\r\n";
-    // Send the chunked data to client.
-    os << std::hex << msg.size() << "\r\n";
-    // Write the actual data for the line.
-    os << msg << "\r\n";
-    // Send trailer out to end stream to client.
-    os << "0\r\n\r\n";
-}
+    \param[in] errFd The read-end of the child's std::cerr pipe.
 
-/**
- * Obtain the mime type of data based on file extension.
- * 
- * @param path The path from where the file extension is to be determined.
- * 
- * @return The mime type associated with the contents of the file.
+    \param[out] os The output stream to the client.
+
+    \param[in] genChart If true the data for the chart is generated.
+
+    \param[in] keepAlive If true the connection is kept open.
+
+    \param[in] encoding The content coding for the response.
+
+    \param[in] timing Extra headers with the queue and spawn times.
+
+    \param[in] config The server settings.
  */
-std::string getMimeType(const std::string& path) {
-    const size_t dotPos = path.rfind('.');
-    if (dotPos != std::string::npos) {
-        const std::string ext = path.substr(dotPos + 1);
-        if (ext == "html") {
-            return "text/html";
-        } else if (ext == "png") {
-            return "image/png";
-        } else if (ext == "jpg") {
-            return "image/jpeg";
-        }
+void sendChildOutput(ChildJob& job, int outFd, int errFd, std::ostream& os,
+        bool genChart, bool keepAlive, Encoding encoding,
+        const std::string& timing, const ServerConfig& config) {
+    // First write the fixed HTTP header.
+    os << "HTTP/1.1 200 OK\r\n"
+       << "Content-Type: text/html\r\n"
+       << "Transfer-Encoding: chunked\r\n" << encodingHeader(encoding)
+       << timing << connectionHeader(keepAlive) << "\r\n";
+    ChunkedStreamBuf chunked(os, config.chunkSize, encoding,
+                             config.compression.level);
+    std::ostream out(&chunked);
+    HTTP(out) << std::flush;
+    copyChildOutput(job, outFd, errFd, out, config.chunkSize);
+    // Wait for the monitor to reap the process and get exit code.
+    const int exitCode = decodeExitStatus(job.waitExit());
+    // Create exit code information and send to client.
+    out << "\r\nExit code: " << std::to_string(exitCode) << "\r\n";
+    if (const char* reason = job.getTermination()) {
+        out << "Terminated: " << reason << "\r\n";
     }
-    // In all cases return default mime type.
-    return "text/plain";
+    printData(genChart, out, job.samples(), job.getPeakRss());
+    out.flush();
+    chunked.finish();
 }
 
-/** Convenience method to split a given string into words.
+/** Send the output, exit code, and runtime statistics of a child
+    process to the client as a single JSON object of the form:
 
-    This method is just a copy-paste of example code from lecture
-    slides.
+        {"output": "...", "exitCode": 0, "peakRss": 1024,
+         "samples": [{"time": 1.00, ...}, ...]}
 
-    \param[in] str The string to be split
+    The output is escaped and sent as it is generated; the rest follows
+    once the child has exited.  Samples use the same fields as the
+    "sample" events of streamChildOutput.
 
-    \return A vector of words
+    \param[in] job The child process whose output is to be sent.
+
+    \param[in] outFd The read-end of the child's std::cout pipe.
+
+    \param[in] errFd The read-end of the child's std::cerr pipe.
+
+    \param[out] os The output stream to the client.
+
+    \param[in] keepAlive If true the connection is kept open.
+
+    \param[in] encoding The content coding for the response.
+
+    \param[in] timing Extra headers with the queue and spawn times.
+
+    \param[in] config The server settings.
  */
-std::vector<std::string> split(std::string str) {
-    std::istringstream is(str);
-    std::string word;
-    std::vector<std::string> list;
-    while (is >> word) {
-        list.push_back(word);
+void sendJsonOutput(ChildJob& job, int outFd, int errFd, std::ostream& os,
+        bool keepAlive, Encoding encoding, const std::string& timing,
+        const ServerConfig& config) {
+    os << "HTTP/1.1 200 OK\r\n"
+       << "Content-Type: application/json\r\n"
+       << "Transfer-Encoding: chunked\r\n" << encodingHeader(encoding)
+       << timing << connectionHeader(keepAlive) << "\r\n";
+    ChunkedStreamBuf chunked(os, config.chunkSize, encoding,
+                             config.compression.level);
+    std::ostream out(&chunked);
+    {
+        ReportWriter writer(out);
+        writer << "{\"output\": \"";
+        readChildOutput(job, outFd, errFd, config.chunkSize,
+            [&writer, &out](const char* data, size_t count) {
+                writer.jsonString(data, count).flush();
+                return out.flush().good();  // Send output right away
+            });
+        const int exitCode = decodeExitStatus(job.waitExit());
+        writer << "\", \"exitCode\": " << std::to_string(exitCode)
+               << ", \"terminated\": " << terminationJson(job)
+               << ", \"peakRss\": " << job.getPeakRss() * PageSize / 1000
+               << ", \"samples\": [";
+        const std::vector<ProcSample> samples = job.samples();
+        for (size_t i = 0; (i < samples.size()); i++) {
+            writer << ((i == 0) ? "" : ", ");
+            sampleJson(writer, samples[i]);
+        }
+        writer << "]}\n";
     }
-    return list;
+    out.flush();
+    chunked.finish();
 }
 
-/** Uses execvp to run the child process.
+/** Send the runtime statistics of a child process to the client as a
+    CSV table with one row per sample.
 
-    This method is a helper method that is used to run the child
-    process using the execvp command.  This method is called onlyl on
-    the child process from the exec() method in this source file.
+    The output of the child is discarded.  The response is sent once
+    the child has exited so that the exit code and peak RSS (in KB) can
+    be sent in the X-Exit-Code and X-Peak-RSS headers.
 
-    \param[in] argList The list of command-line arguments.  The 1st
-    entry is assumed to the command to be executed.
-*/
-void runChild(std::vector<std::string> argList) {
-    // Setup the command-line arguments for execvp.  The following
-    // code is a copy-paste from lecture slides.
-    std::vector<char*> args;
-    for (size_t i = 0; (i < argList.size()); i++) {
-        args.push_back(&argList[i][0]);
-    }
-    // nullptr is very important
-    args.push_back(nullptr);
-    // Finally run the command in child process
-    execvp(args[0], &args[0]);  // Run the command!
-    // If control drops here, then the command was not found!
-    std::cout << "Command " << argList[0] << " not found!\n";
-    // Exit out of child process with error exit code.    
-    exit(0);
-}
-
-// A method to resolve issues with decimals and shorten the lengths
-// of float values to 2 decimal places.
-std::string decimals(float number) {
-    std::string dec;
-    float val = static_cast<int>(number * 100);
-    float round = val / 100;
-    std::string rounded = std::to_string(round);
-    if (round == 0) {
-        dec = rounded.substr(0, rounded.find('.'));
-    } else {
-        dec = rounded.substr(0, rounded.find('.')+ 3);
+    \param[in] job The child process whose statistics are to be sent.
+
+    \param[in] outFd The read-end of the child's std::cout pipe.
+
+    \param[in] errFd The read-end of the child's std::cerr pipe.
+
+    \param[out] os The output stream to the client.
+
+    \param[in] keepAlive If true the connection is kept open.
+
+    \param[in] encoding The content coding for the response.
+
+    \param[in] timing Extra headers with the queue and spawn times.
+
+    \param[in] config The server settings.
+ */
+void sendCsvOutput(ChildJob& job, int outFd, int errFd, std::ostream& os,
+        bool keepAlive, Encoding encoding, const std::string& timing,
+        const ServerConfig& config) {
+    readChildOutput(job, outFd, errFd, config.chunkSize,
+                    [](const char*, size_t) { return true; });
+    const int exitCode = decodeExitStatus(job.waitExit());
+    const char* reason = job.getTermination();
+    os << "HTTP/1.1 200 OK\r\n"
+       << "Content-Type: text/csv\r\n"
+       << "Transfer-Encoding: chunked\r\n"
+       << "X-Exit-Code: " << std::dec << exitCode << "\r\n"
+       << "X-Peak-RSS: " << job.getPeakRss() * PageSize / 1000 << "\r\n";
+    if (reason != nullptr) {
+        os << "X-Terminated: " << reason << "\r\n";
     }
-    std::string copy = dec;
-    if (copy.substr(1) == ".00") {
-        dec = dec.substr(0);
+    os << encodingHeader(encoding) << timing << connectionHeader(keepAlive)
+       << "\r\n";
+    ChunkedStreamBuf chunked(os, config.chunkSize, encoding,
+                             config.compression.level);
+    std::ostream out(&chunked);
+    {
+        ReportWriter writer(out);
+        writer << "time,utime,stime,vsize,rss,processes,read,written,"
+            "switches\n";
+        for (const ProcSample& sample : job.samples()) {
+            writer.decimals(sample.elapsed) << ',';
+            writer.decimals(float(sample.utime) / ClockTicks) << ',';
+            writer.decimals(float(sample.stime) / ClockTicks) << ','
+                << sample.vsize / 1000 << ','
+                << sample.rss * PageSize / 1000 << ','
+                << sample.processes << ','
+                << sample.readBytes / 1000 << ','
+                << sample.writeBytes / 1000 << ','
+                << sample.ctxSwitches << '\n';
+        }
     }
-    return dec;
+    out.flush();
+    chunked.finish();
 }
 
-// Opens the /proc/[pid]/stat file on the server. Obtains usertime, systemtime
-// and current size of memory by the program and returns a string vector of
-// the three obtained values.
-std::vector<string> getProc(int pid) {
-    std::string file = "/proc/" + std::to_string(pid) + "/stat";
-    std::ifstream dataFile(file);
-    std::string line;
-    std::getline(dataFile, line);
-    std::istringstream is(line);
-    std::vector<std::string> list;
-    std::string word;
-    int counter = 0;
-        while (is >> word) {
-            counter++;
-            if (counter == 14) {
-                float utime = std::stof(word);
-                utime = utime / sysconf(_SC_CLK_TCK);
-                std::string converted = decimals(utime);
-                list.push_back(converted);
-            }
-            if (counter == 15) {
-                float stime = std::stof(word);
-                stime = stime / sysconf(_SC_CLK_TCK);
-                std::string converted = decimals(stime);
-                list.push_back(converted);
-            }
-            if (counter == 23) {
-                long vsize = std::stol(word);
-                vsize = vsize / 1000;
-                list.push_back(std::to_string(vsize));
-            }
-        }
-    return list;
+/** Helper method to send HTTP 503 message back to the client when too
+    many CGI requests are already waiting to run.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] keepAlive If true the connection is kept open.
+ */
+void send503(std::ostream& os, bool keepAlive) {
+    const std::string msg = "Server is busy. Please try again later.";
+    os << "HTTP/1.1 503 Service Unavailable\r\n"
+       << "Content-Type: text/plain\r\n"
+       << "Content-Length: " << std::dec << msg.size() << "\r\n"
+       << "Retry-After: 1\r\n"
+       << connectionHeader(keepAlive) << "\r\n" << msg;
 }
 
-// Prints out html code used in the program to the ostream and chunks it
-std::ostream& HTTP(std::ostream& os) {
-    std::string text = 
-        "<html>\n"
-       "  <head>\n"
-       "    <script type='text/javascript' "
-       "src='https://www.gstatic.com/charts/loader.js'></script>\n"
-       "    <script type='text/javascript' src='/draw_chart.js'></script>\n"
-       "    <link rel='stylesheet' type='text/css' href='/mystyle.css'>\n"
-       "  </head>\n\n"
-       "  <body>\n"
-       "    <h3>Output from program</h3>\n"
-       "    <textarea style='width: 700px; height: 200px'>\n";
-    os << std::hex << text.size() << "\r\n";
-    os << text << "\r\n";   
-    return os;
+/** Helper method to send an error message back to the client when a
+    request could not be parsed.  The connection is always closed as
+    the rest of the request cannot be skipped reliably.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] status The HTTP status code, i.e., 400 (malformed
+    request) or 431 (request line or headers too large).
+ */
+void sendBadRequest(std::ostream& os, int status) {
+    const std::string msg = (status == 431) ?
+        "Request Header Fields Too Large" : "Bad Request";
+    os << "HTTP/1.1 " << std::dec << status << ' ' << msg << "\r\n"
+       << "Content-Type: text/plain\r\n"
+       << "Content-Length: " << msg.size() << "\r\n"
+       << connectionHeader(false) << "\r\n" << msg;
 }
 
-// Generates a vector of data for the table by calling getProc and returning
-// a string vector
-std::vector<string> rowGen(int pid) { 
-    std::vector<std::string> data = getProc(pid);
-    return data;
+/** Send a JSON document back to the client.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] status The HTTP status code and message, e.g., "200 OK".
+
+    \param[in] msg The JSON document to be sent.
+
+    \param[in] keepAlive If true the connection is kept open.
+ */
+void sendJson(std::ostream& os, const std::string& status,
+              const std::string& msg, bool keepAlive) {
+    os << "HTTP/1.1 " << status << "\r\n"
+       << "Content-Type: application/json\r\n"
+       << "Content-Length: " << std::dec << msg.size() << "\r\n"
+       << "Cache-Control: no-cache\r\n"
+       << connectionHeader(keepAlive) << "\r\n" << msg;
 }
 
-// Generates the HTML code for a row of the table using the vector containing
-// vectors of string data from the proc file
-std::string tableGen(std::vector<std::vector<std::string>> contents) {
-    std::string line; 
-    int counter = 0;
-    
-    for (size_t i = 0; i < contents.size(); i++) {
-        counter++;
-        std::vector<std::string> temp = contents[i];
-        line += "       <tr><td>" + std::to_string(counter) + "</td><td>"
-        + temp[0] + "</td><td>" + temp[1]+ "</td><td>" + temp[2]+
-                "</td></tr>\n";
-    }
-    return line;
+/** Send the server metrics (see ServerMetrics) back to the client in
+    the Prometheus text format.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] keepAlive If true the connection is kept open.
+ */
+void sendMetrics(std::ostream& os, bool keepAlive) {
+    std::ostringstream body;
+    metrics.write(body);
+    const std::string msg = body.str();
+    os << "HTTP/1.1 200 OK\r\n"
+       << "Content-Type: text/plain; version=0.0.4\r\n"
+       << "Content-Length: " << std::dec << msg.size() << "\r\n"
+       << "Cache-Control: no-cache\r\n"
+       << connectionHeader(keepAlive) << "\r\n" << msg;
 }
 
-// Generates the JSON data for the Google chart using the data from the proc
-// file. HTML is then written to a string.
-std::string chartGen(std::vector<std::vector<string>> tableData) {
-    string chart;
-    int counter = 0;
-    for (size_t i = 0; i < tableData.size(); i++) {
-        counter++;
-        std::vector<std::string> temp = tableData[i];
-        if (i != tableData.size()-1) {
-        chart += "          [" + std::to_string(counter) + ", " +
-                temp[0] + ", " + temp[2] + "],\n";
+/** List the running CGI jobs, or cancel one of them, and send the
+    result to the client as JSON.
+
+    Without parameters the jobs are listed as {"jobs": [{"id": 1,
+    "pid": 123, "command": "sleep 100", "time": 1.00, "cpu": 0,
+    "rss": 1024, "processes": 1}, ...]} using the most recent sample
+    of each job.  With "cancel=<id>" the job is killed and the result
+    is {"id": <id>, "cancelled": true} (false if no such job is
+    running).
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] keepAlive If true the connection is kept open.
+
+    \param[in] query The query string of the request.
+ */
+void sendJobs(std::ostream& os, bool keepAlive, std::string_view query) {
+    std::ostringstream body;
+    {
+        ReportWriter out(body);
+        const std::string_view cancel = queryParam(query, "cancel");
+        if (!cancel.empty()) {
+            uint64_t id = 0;
+            std::from_chars(cancel.data(), cancel.data() + cancel.size(), id);
+            const ChildJobPtr job = runningJobs.find(id);
+            const bool cancelled = job && job->cancel("cancelled");
+            out << "{\"id\": " << id << ", \"cancelled\": "
+                << (cancelled ? "true" : "false") << "}\n";
         } else {
-            chart += "          [" + std::to_string(counter) +  ", " +
-                    temp[0] + ", " + temp[2] + "]\n";
+            out << "{\"jobs\": [";
+            const char* sep = "";
+            for (const ChildJobPtr& job : runningJobs.list()) {
+                const ProcSample last = job->lastSample();
+                const std::string& cmd = job->getCommand();
+                out << sep << "{\"id\": " << job->getId()
+                    << ", \"pid\": " << uint64_t(job->getPid())
+                    << ", \"command\": \"";
+                out.jsonString(cmd.data(), cmd.size()) << "\", \"time\": ";
+                out.decimals(last.elapsed) << ", \"cpu\": ";
+                out.decimals(float(last.utime + last.stime) / ClockTicks)
+                    << ", \"rss\": " << last.rss * PageSize / 1000
+                    << ", \"processes\": " << last.processes << '}';
+                sep = ", ";
+            }
+            out << "]}\n";
         }
     }
-    return chart;
+    sendJson(os, "200 OK", body.str(), keepAlive);
 }
 
-// Ends the HTML region, adds the HTML for the table, along with JSON data for
-// the Google chart. Chunked data is returned.
-void printData(bool genChart, std::ostream& os, 
-    std::vector<std::vector<string>> tableData) {
-    std::string brackets = "", comma = "", empty = "";
-    std::string table = tableGen(tableData);
-    if (genChart) {
-        brackets = chartGen(tableData);
-        comma = ",";
+/** Run a CGI command in the background and send its job id to the
+    client right away as {"id": 1, "pid": 123, "result":
+    "/cgi-bin/result?id=1"}.
+
+    The output of the command is spooled in memory by childMonitor
+    (keeping at most the configured spool size) and can be fetched via
+    cgi-bin/result.  The command holds a slot of cgiSlots until it
+    exits, but a submission never waits for a slot: if none is free
+    a 503 is sent.  At most config.maxJobs results are kept; the
+    oldest finished job is dropped to make room, and a 503 is sent if
+    all of them are still running.
+
+    \param[in] cmd The command to run.
+
+    \param[in] args The command-line arguments for the command.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] keepAlive If true the connection is kept open.
+
+    \param[in] config The limits for the command.
+ */
+void submit(const std::string& cmd, const std::string& args,
+            std::ostream& os, bool keepAlive, const ServerConfig& config) {
+    using namespace std::chrono;
+    submittedJobs.collect(config.jobTtl);
+    if (!submittedJobs.makeRoom(config.maxJobs) || !cgiSlots.tryAcquire()) {
+        metrics.add(Stat::CgiRejected);
+        send503(os, keepAlive);
+        return;
     }
-    std::string text = 
-            "     </textarea>\n"
-            "     <h2>Runtime statistics</h2>\n     <table>\n"
-            "       <tr><th>Time (sec)</th><th>User time</th><th>System time"
-            "</th><th>Memory (KB)</th></tr>\n"
-            + table +
-            "     </table>\n"
-            "     <div id='chart' style='width: 900px; height: 500px'></div>\n"
-            "  </body>\n" "  <script type='text/javascript'>\n"
-            "    function getChartData() {\n"
-            "      return google.visualization.arrayToDataTable(\n"
-            "        [\n          ['Time (sec)', 'CPU Usage', "
-            "'Memory Usage']" + comma +"\n" + brackets 
-            + "        ]\n      );\n    }\n  </script>\n</html>\n";
-    os << std::hex << text.size() << "\r\n";
-    os << text << "\r\n"; 
-    os << std::hex << empty.size() << "\r\n\r\n";
+    std::vector<std::string> cmdArgs = split(args);
+    cmdArgs.insert(cmdArgs.begin(), cmd);
+    int outPipe[2], errPipe[2];
+    pipe2(outPipe, O_CLOEXEC);
+    pipe2(errPipe, O_CLOEXEC);
+    const auto started = steady_clock::now();
+    const pid_t pid    = spawnChild(cmdArgs, outPipe[WRITE], errPipe[WRITE]);
+    const auto spawned = steady_clock::now();
+    close(outPipe[WRITE]);
+    close(errPipe[WRITE]);
+    metrics.recordCgiSpawn(duration_cast<microseconds>(spawned -
+                                                       started).count());
+    if (pid == -1) {
+        metrics.add(Stat::CgiSpawnFailed);
+        close(outPipe[READ]);
+        close(errPipe[READ]);
+        cgiSlots.release();
+        std::ostringstream body;
+        ReportWriter(body).jsonString(cmd.data(), cmd.size());
+        sendJson(os, "404 Not Found", "{\"error\": \"command not found\", "
+                 "\"command\": \"" + body.str() + "\"}\n", keepAlive);
+        return;
+    }
+    metrics.add(Stat::CgiSpawned);
+    setChildLimits(pid, config);
+    ChildJobPtr job = std::make_shared<ChildJob>(pid,
+        args.empty() ? cmd : (cmd + " " + args), -1, config);
+    // Free the slot once the command exits, whether or not its result
+    // is ever fetched.
+    const uint64_t id = job->getId();
+    job->setOnExit([id, spawned] {
+        runningJobs.remove(id);
+        cgiSlots.release();
+        metrics.add(Stat::CgiExited);
+        metrics.recordCgiRun(duration_cast<microseconds>(steady_clock::now()
+                                                         - spawned).count());
+    });
+    runningJobs.add(job);
+    submittedJobs.add(job);
+    childMonitor.watchOutput(job, outPipe[READ], errPipe[READ]);
+    childMonitor.watch(job);
+    sendJson(os, "202 Accepted", "{\"id\": " + std::to_string(id) +
+             ", \"pid\": " + std::to_string(pid) +
+             ", \"result\": \"/cgi-bin/result?id=" + std::to_string(id) +
+             "\"}\n", keepAlive);
 }
 
-/** Helper method to send the data to client in chunks.
-    
-    This method is a helper method that is used to send data to the
-    client line-by-line.
+/** Send the spooled output and status of a job started via
+    cgi-bin/submit to the client.
 
-*/
-void sendMoreData(const std::string& mimeType, int pid,
-              std::istream& is, std::ostream& os,
-        std::vector<std::vector<string>> &table, bool genChart, 
-        std::thread &t1) {
-    // First write the fixed HTTP header.
-    os << "HTTP/1.1 200 OK\r\n"
-       << "Content-Type: " << mimeType << "\r\n"        
-       << "Transfer-Encoding: chunked\r\n"
-       <<"Connection: Close\r\n\r\n";
-    // Read line-by line from child-process and write results to
-    // client.
-    
-    std::string line;
-    if (pid != -1) {
-        HTTP(os);
-    }
-    while (std::getline(is, line)) {
-        // Add required "\n" to terminate the line.
-        line += "\n";
-        // Add size of line in hex
-        os << std::hex << line.size() << "\r\n";
-        // Write the actual data for the line.
-        os << line << "\r\n";
-    }
-    // Check if we need to end out exit code
-    t1.join();
-    if (pid != -1) {
-        // Wait for process to finish and get exit code.
-        int exitCode = 0;
-        waitpid(pid, &exitCode, 0);
-        // Create exit code information and send to client.
-        line = "\r\nExit code: " + std::to_string(exitCode) + "\r\n";
-        os << std::hex << line.size() << "\r\n" << line << "\r\n";
-    }
-    printData(genChart, os, table);
-}
-
-// Method to handle threading in the program. This method obtains data from
-// the proc file once every second and pushes it into a vector.
-void threaded(int pid, std::vector<std::vector<string>>& tableHTML) {
-    int exitCode = 0;
-        
-        while (waitpid(pid, &exitCode, WNOHANG) == 0) {
-            sleep(1);  // sleep for 1 second.
-            tableHTML.push_back(rowGen(pid));
-            // Record current statistics about the process.
-        }
-        sleep(1);
-}
-
-// Executes code to create a thread to be gather data from the proc file, then
-// redirects it to the sendMoreData method.
-void exec(std::string cmd, std::string args, std::ostream& os, bool genChart) {
+    The query has the job "id" and optionally the "offset" of the first
+    byte of output wanted (so clients can tail the output by passing
+    the nextOffset of the previous result).  The result is {"id": 1,
+    "status": "running", "exitCode": null, "terminated": null,
+    "offset": 0, "nextOffset": 6, "output": "hello\n"}.  The offset
+    is larger than the requested one if older output was dropped from
+    the spool.  The status is "done" once the command has exited and
+    all of its output is spooled.  Unknown (or expired) jobs get a 404.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] keepAlive If true the connection is kept open.
+
+    \param[in] query The query string of the request.
+
+    \param[in] config The server settings (for the time to keep
+    results).
+ */
+void sendResult(std::ostream& os, bool keepAlive, std::string_view query,
+                const ServerConfig& config) {
+    submittedJobs.collect(config.jobTtl);
+    const std::string_view idParam = queryParam(query, "id");
+    const std::string_view offsetParam = queryParam(query, "offset");
+    uint64_t id = 0, offset = 0;
+    std::from_chars(idParam.data(), idParam.data() + idParam.size(), id);
+    std::from_chars(offsetParam.data(), offsetParam.data() +
+                    offsetParam.size(), offset);
+    const ChildJobPtr job = submittedJobs.find(id);
+    if (!job) {
+        sendJson(os, "404 Not Found", "{\"id\": " + std::to_string(id) +
+                 ", \"error\": \"no such job\"}\n", keepAlive);
+        return;
+    }
+    std::string output;
+    uint64_t start = 0;
+    const bool done = job->readSpool(offset, output, start);
+    const int status = job->getExitStatus();
+    std::ostringstream body;
+    {
+        ReportWriter out(body);
+        out << "{\"id\": " << id << ", \"status\": \""
+            << (done ? "done" : "running") << "\", \"exitCode\": ";
+        if (status == -1) {
+            out << "null";
+        } else {
+            out << std::to_string(decodeExitStatus(status));
+        }
+        out << ", \"terminated\": " << terminationJson(*job)
+            << ", \"offset\": " << start << ", \"nextOffset\": "
+            << start + output.size() << ", \"output\": \"";
+        out.jsonString(output.data(), output.size()) << "\"}\n";
+    }
+    sendJson(os, "200 OK", body.str(), keepAlive);
+}
+
+// Starts the command with childMonitor gathering data from the proc file, then
+// redirects it to the sendChildOutput or streamChildOutput method.  The
+// number of commands running at the same time is limited by cgiSlots.  While
+// running, the command is listed in runningJobs and is killed if it exceeds
+// its limits or the client (sockFd, if not -1) closes the connection.  The
+// output is compressed using the given encoding.
+void exec(std::string cmd, std::string args, std::ostream& os, bool genChart,
+          bool keepAlive, CgiOutput format, Encoding encoding,
+          const ServerConfig& config, int sockFd) {
+    using namespace std::chrono;
     // Split string into individual command-line arguments.
     std::vector<std::string> cmdArgs = split(args);
     // Add command as the first of cmdArgs as per convention.
     cmdArgs.insert(cmdArgs.begin(), cmd);
-    // Setup pipes to obtain inputs from child process
-    int pipefd[2];
-    pipe(pipefd);
-    // Finally fork and exec with parent having more work to do.
-    const int pid = fork();
-    if (pid == 0) {
-        close(pipefd[READ]);        // Close unused end.
-        dup2(pipefd[WRITE], 1);     // Tie/redirect std::cout of command
-        runChild(cmdArgs);
+    // Wait for our turn to run a command.
+    const auto queued = steady_clock::now();
+    if (!cgiSlots.acquire()) {
+        metrics.add(Stat::CgiRejected);
+        send503(os, keepAlive);
+        return;
+    }
+    // Setup pipes to obtain outputs from child process
+    int outPipe[2], errPipe[2];
+    pipe2(outPipe, O_CLOEXEC);
+    pipe2(errPipe, O_CLOEXEC);
+    const auto started = steady_clock::now();
+    const pid_t pid    = spawnChild(cmdArgs, outPipe[WRITE], errPipe[WRITE]);
+    const auto spawned = steady_clock::now();
+    close(outPipe[WRITE]);
+    close(errPipe[WRITE]);
+    // Report how long the request waited and spawning took.
+    const std::string timing = !config.timingHeaders ? "" :
+        "X-CGI-Queue-Wait-Us: " +
+        std::to_string(duration_cast<microseconds>(started - queued).count())
+        + "\r\nX-CGI-Spawn-Us: " +
+        std::to_string(duration_cast<microseconds>(spawned - started).count())
+        + "\r\n";
+    metrics.recordCgiSpawn(duration_cast<microseconds>(spawned -
+                                                       started).count());
+    if (pid == -1) {
+        // The command could not be run.
+        metrics.add(Stat::CgiSpawnFailed);
+        const std::string msg = "Command " + cmd + " not found!\n";
+        std::istringstream is(msg);
+        sendMoreData("text/plain", is, os, keepAlive, config);
     } else {
-        std::vector<std::vector<string>> tableData;
-        std::thread t1(threaded, pid, std::ref(tableData));
-
-        close(pipefd[WRITE]);
-        __gnu_cxx::stdio_filebuf<char> fb(pipefd[READ], std::ios::in, 1);
-        std::istream is(&fb);
+        metrics.add(Stat::CgiSpawned);
+        setChildLimits(pid, config);
+        ChildJobPtr job = std::make_shared<ChildJob>(pid,
+            args.empty() ? cmd : (cmd + " " + args), sockFd, config);
+        childMonitor.watch(job);
+        runningJobs.add(job);
         // Have helper method process the output of child-process
-        sendMoreData("text/html", pid, is, os, std::ref(tableData),
-                genChart, t1);
+        if (format == CgiOutput::EventStream) {
+            streamChildOutput(*job, outPipe[READ], errPipe[READ], os,
+                              keepAlive, encoding, timing, config);
+        } else if (format == CgiOutput::Json) {
+            sendJsonOutput(*job, outPipe[READ], errPipe[READ], os,
+                           keepAlive, encoding, timing, config);
+        } else if (format == CgiOutput::Csv) {
+            sendCsvOutput(*job, outPipe[READ], errPipe[READ], os,
+                          keepAlive, encoding, timing, config);
+        } else {
+            sendChildOutput(*job, outPipe[READ], errPipe[READ], os,
+                            genChart, keepAlive, encoding, timing, config);
+        }
+        runningJobs.remove(job->getId());
+        metrics.add(Stat::CgiExited);
+        metrics.recordCgiRun(duration_cast<microseconds>(steady_clock::now() -
+                                                         spawned).count());
+    }
+    close(outPipe[READ]);
+    close(errPipe[READ]);
+    cgiSlots.release();
+}
+
+/** Send the response to a CGI command that may be cached (see
+    ServerConfig::cacheCmds), running the command only if there is no
+    fresh response in cgiResults.
+
+    The response is generated in memory as for a persistent connection
+    (and without watching for the client closing its connection, since
+    other requests may be waiting for the same response).  The
+    Connection header is then set for this request and X-Cache (HIT or
+    MISS) and Age headers are added.  The parameters are the same as
+    for exec.  Compressed responses are cached separately.
+ */
+void execCached(const std::string& cmd, const std::string& args,
+                std::ostream& os, bool genChart, bool keepAlive,
+                CgiOutput format, Encoding encoding,
+                const ServerConfig& config) {
+    const int cmdTtl = config.cacheCmds.at(cmd);
+    const int ttl    = (cmdTtl > 0) ? cmdTtl : config.cacheTtl;
+    std::string key;
+    key.append(1, static_cast<char>(format))
+        .append(1, static_cast<char>(encoding))
+        .append(1, genChart ? 'c' : '-').append(cmd).append(1, '\0')
+        .append(args);
+    int age  = 0;
+    bool hit = false;
+    const auto response = cgiResults.get(key, ttl, [&] {
+            std::ostringstream out;
+            exec(cmd, args, out, genChart, true, format, encoding, config,
+                 -1);
+            return out.str();
+        }, age, hit);
+    metrics.add(hit ? Stat::CgiCacheHits : Stat::CgiCacheMisses);
+    // Swap in the Connection header for this request.
+    const std::string persistent = connectionHeader(true);
+    const size_t headEnd = response->find("\r\n\r\n");
+    const size_t conn    = response->find(persistent);
+    if ((headEnd == std::string::npos) || (conn > headEnd)) {
+        os << *response;
+        return;
     }
+    os.write(response->data(), conn);
+    os << connectionHeader(keepAlive) << "X-Cache: " << (hit ? "HIT" : "MISS")
+       << "\r\nAge: " << std::dec << age << "\r\n";
+    os.write(response->data() + conn + persistent.size(),
+             response->size() - conn - persistent.size());
 }
 
 /**
@@ -427,40 +4329,136 @@ void exec(std::string cmd, std::string args, std::ostream& os, bool genChart) {
  * @param is The input stream to read data from client.
  * @param os The output stream to send data to client.
  * @param genChart If this flag is true then generate data for chart.
+ * @param config The server settings to be used.
+ * @param persistent If this flag is true then the connection may be
+ * kept open if the client asks for it.
+ * @param sockFd The native socket handle for os, or -1 if os is not
+ * a socket.  Used to send large files without copying.
+ * @return True if the connection can be used for another request.
  */
-void serveClient(std::istream& is, std::ostream& os, bool genChart) {
-    // Read headers from client and print them. This server
-    // does not really process client headers
-    std::string line;
-    // Read the GET request line.
-    std::getline(is, line);
-    const std::string path = getFilePath(line);
-    // Skip/ignore all the HTTP request & headers for now.
-    while (std::getline(is, line) && (line != "\r")) {}
+bool serveClient(std::istream& is, std::ostream& os, bool genChart,
+                 const ServerConfig& config, bool persistent, int sockFd) {
+    // Read the request line and the headers we use.
+    Request req;
+    const int status = readRequest(is, req);
+    const auto start = std::chrono::steady_clock::now();
+    // Record the time taken for the response once it has been sent.
+    const auto recordTime = [&start](Route route) {
+        metrics.recordRequest(route, std::chrono::duration_cast<
+            std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                       start).count());
+    };
+    if (status != 200) {
+        if (status != 0) {
+            sendBadRequest(os, status);
+            os.flush();
+            recordTime(Route::BadRequest);
+        }
+        return false;
+    }
+    const bool keepAlive = persistent && req.keepAlive;
+    // The content coding for a (streamed) response of the given type.
+    const auto encodingFor = [&req, &config](std::string_view mimeType) {
+        return config.compression.allows(mimeType, std::string::npos) ?
+            acceptedEncoding(req.acceptEncoding) : Encoding::Identity;
+    };
+    std::string path;
+    urlDecode(req.path, path);
     // Check and dispatch the request appropriately
-    const std::string cgiPrefix = "cgi-bin/exec?cmd=";
-    const int prefixLen         = cgiPrefix.size();
-    if (path.substr(0, prefixLen) == cgiPrefix) {
+    Route route = Route::Static;
+    const bool isSse = (path == "cgi-bin/stream");
+    if (path == "metrics") {
+        route = Route::Metrics;
+        sendMetrics(os, keepAlive);
+    } else if (path == "cgi-bin/jobs") {
+        route = Route::Jobs;
+        sendJobs(os, keepAlive, req.query);
+    } else if (path == "cgi-bin/result") {
+        route = Route::Jobs;
+        sendResult(os, keepAlive, req.query, config);
+    } else if (path == "cgi-bin/submit") {
+        route = Route::Cgi;
+        std::string cmd, args;
+        urlDecode(queryParam(req.query, "cmd"), cmd);
+        urlDecode(queryParam(req.query, "args"), args);
+        submit(cmd, args, os, keepAlive, config);
+    } else if (isSse || (path == "cgi-bin/exec")) {
+        route = Route::Cgi;
         // Extract the command and parameters for exec.
-        const size_t argsPos   = path.find("&args=", prefixLen);
-        const std::string cmd  = path.substr(prefixLen, argsPos - prefixLen);
-        const std::string args = url_decode(path.substr(argsPos + 6));
-        // Now run the command and return result back to client.
-        exec(cmd, args, os, genChart);
+        std::string cmd, args;
+        urlDecode(queryParam(req.query, "cmd"), cmd);
+        urlDecode(queryParam(req.query, "args"), args);
+        // The output format can be chosen for cgi-bin/exec.
+        const std::string_view format = queryParam(req.query, "format");
+        const CgiOutput output = isSse ? CgiOutput::EventStream :
+            (format == "json") ? CgiOutput::Json :
+            (format == "csv")  ? CgiOutput::Csv : CgiOutput::Html;
+        const Encoding encoding = encodingFor(
+            isSse ? "text/event-stream" :
+            (output == CgiOutput::Json) ? "application/json" :
+            (output == CgiOutput::Csv)  ? "text/csv" : "text/html");
+        // Now run the command (or use a cached response) and return
+        // result back to client.
+        if (!isSse && config.cacheCmds.count(cmd)) {
+            execCached(cmd, args, os, genChart, keepAlive, output, encoding,
+                       config);
+        } else {
+            exec(cmd, args, os, genChart, keepAlive, output, encoding,
+                 config, sockFd);
+        }
+    } else if (CachedFilePtr file = localFiles->get(path)) {
+        // Hot files are sent directly from memory.
+        sendCached(os, *file, path, req, keepAlive);
+    } else if ((sockFd != -1) && (!req.range.empty() ||
+                                  (encodingFor(getMimeType(path)) ==
+                                   Encoding::Identity)) &&
+               sendLargeFile(os, sockFd, path, req, keepAlive)) {
+        // Files too big to cache are sent without copying, unless
+        // they are compressed as they are sent.
     } else {
         // Get the file size (if path exists)
-        std::ifstream dataFile(path);
+        std::ifstream dataFile(path, std::ios::binary);
         if (!dataFile.good()) {
             // Invalid file/File not found. Return 404 error message.
-            send404(os, path);
+            route = Route::NotFound;
+            send404(os, path, keepAlive);
         } else {
-            std::vector<std::vector<string>> a;
-            std::thread t1;
             // Send contents of the file to the client.
-            sendMoreData(getMimeType(path), -1, dataFile, os,
-                    a, genChart, t1);
+            const std::string mimeType = getMimeType(path);
+            sendMoreData(mimeType, dataFile, os, keepAlive, config,
+                         encodingFor(mimeType));
         }
     }
+    // Ensure the complete response is sent before the next request.
+    os.flush();
+    recordTime(route);
+    return keepAlive && os.good();
+}
+
+/**
+ * Runs the program as a server that listens to incoming connections.
+ * The shared state is set up from the options in the HW7_OPTIONS
+ * environment variable (see parseOptions) and the server is run in
+ * the requested mode.
+ *
+ * @param port The port number on which the server should listen.
+ */
+void runServer(int port) {
+    const char* options = std::getenv("HW7_OPTIONS");
+    const ServerConfig config = parseOptions(options ? options : "");
+    // Clients closing early should not kill the whole server.
+    signal(SIGPIPE, SIG_IGN);
+    staticFiles.setCapacity(config.cacheBytes);
+    staticFiles.setCompression(config.compression);
+    cgiSlots.setLimits(config.cgiMaxRunning, config.cgiMaxWaiting);
+    childMonitor.setInterval(config.sampleInterval);
+    if (config.shards > 0) {
+        runShardedServer(port, config);
+    } else if (config.async) {
+        runAsyncServer(port, config);
+    } else {
+        runThreadedServer(port, config);
+    }
 }
 
 //------------------------------------------------------------------
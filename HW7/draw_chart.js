@@ -1,20 +1,63 @@
-
 // This script assumes that google charts is loaded before this script
 // in the HTML
 
 google.charts.load('current', {'packages':['corechart']});
 google.charts.setOnLoadCallback(drawChart);
 
+var chartOptions = {
+    title: 'Runtime statistics',
+    legend: { position: 'bottom' },
+    series: {0: {targetAxisIndex: 0}, 1: {targetAxisIndex: 1}}
+};
+
 function drawChart() {
+    // Pages that stream their data (see streamCommand) have no
+    // getChartData function.
+    if (typeof getChartData !== 'function') {
+        return;
+    }
     var data = getChartData();
 
-    var options = {
-        title: 'Runtime statistics',
-        legend: { position: 'bottom' },
-        series: {0: {targetAxisIndex: 0}, 1: {targetAxisIndex: 1}}
-    };
-
     var chart = new google.visualization.LineChart(document.getElementById('chart'));
 
-    chart.draw(data, options);
+    chart.draw(data, chartOptions);
+}
+
+// Runs a command on the server and updates the page as its output and
+// runtime statistics arrive via Server-Sent Events. The page must have
+// a textarea with id 'output', a table with id 'stats', and a div with
+// id 'chart'.
+function streamCommand(cmd, args) {
+    var output = document.getElementById('output');
+    var stats  = document.getElementById('stats');
+    var chart  = new google.visualization.LineChart(document.getElementById('chart'));
+    var data   = google.visualization.arrayToDataTable(
+        [['Time (sec)', 'CPU Usage', 'Memory Usage']]);
+    output.value = '';
+    while (stats.rows.length > 1) {
+        stats.deleteRow(1);
+    }
+    var source = new EventSource('/cgi-bin/stream?cmd=' +
+        encodeURIComponent(cmd) + '&args=' + encodeURIComponent(args));
+    source.addEventListener('output', function(event) {
+        output.value += event.data + '\n';
+    });
+    source.addEventListener('sample', function(event) {
+        var s   = JSON.parse(event.data);
+        var row = stats.insertRow(-1);
+        [s.time, s.utime, s.stime, s.vsize, s.rss, s.processes, s.read,
+         s.written, s.switches].forEach(function(value) {
+            row.insertCell(-1).textContent = value;
+        });
+        data.addRow([s.time, s.utime + s.stime, s.vsize]);
+        chart.draw(data, chartOptions);
+    });
+    source.addEventListener('exit', function(event) {
+        output.value += '\nExit code: ' + JSON.parse(event.data).exitCode + '\n';
+        source.close();
+    });
+    source.onerror = function() {
+        source.close();
+    };
+    return false;
 }
@@ -0,0 +1,578 @@
+/*
+ * File:   loadgen.cpp
+ * Author: bowserbl
+ *
+ * A load generator for the HW7 web server.  It sends requests over
+ * many persistent connections (one thread per connection) and reports
+ * the throughput, error rate, and latency percentiles.
+ *
+ * Two modes are supported:
+ *
+ *   - Closed loop (default): each connection sends its next request as
+ *     soon as the previous response has been received.
+ *
+ *   - Open loop (--rate=R): requests are sent on a fixed schedule of R
+ *     requests/sec in total.  Latency is measured from the time a
+ *     request was *supposed* to be sent, so that a stalled server is
+ *     not hidden by the load generator backing off (i.e., the numbers
+ *     are corrected for coordinated omission).
+ *
+ * In closed-loop mode the corrected numbers are estimated in the same
+ * way as HdrHistogram's recordValueWithExpectedInterval: every sample
+ * longer than the expected interval (the median latency) is
+ * back-filled with the samples that would have been measured had the
+ * requests been sent on schedule.
+ *
+ * Build:
+ *   g++ -std=c++17 -O2 -Wall loadgen.cpp -o loadgen -lboost_system -lpthread
+ *
+ * Usage:
+ *   loadgen <host> <port> [--scenario=small|large|404|cgi]
+ *           [--file=requests.txt] [--connections=16] [--duration=10]
+ *           [--rate=0] [--path=...] [--expect=200] [--large-mb=32]
+ *
+ * Canned scenarios (run the server and loadgen from the HW7 directory):
+ *   small  GET /mystyle.css (a small cached static file).
+ *   large  GET of a file of --large-mb MB that loadgen creates in a
+ *          temporary directory (loadgen-XXXXXX) in the current
+ *          directory and removes afterwards.  The file is bigger than
+ *          the server's static cache takes (1/8th of the cache size),
+ *          so it is sent with sendfile.  Use --path to request an
+ *          existing file instead.
+ *   404    GET of a different missing file for every request.
+ *   cgi    GET /cgi-bin/exec?cmd=sleep&args=1 (override args with
+ *          --path, e.g., --path=0.2).  Run the server with, e.g.,
+ *          HW7_OPTIONS=--cgi-max=4 to see the effect of the CGI
+ *          concurrency limit.
+ *
+ * With --file the requests in the given file (e.g.,
+ * base_case1_inputs.txt) are replayed in turn.  Requests in the file
+ * are separated by blank lines and "\n" line endings are converted to
+ * "\r\n".
+ *
+ * Copyright 2018 Bowserbl
+ */
+
+#include <boost/asio.hpp>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unistd.h>
+
+// Using namespaces to streamline code below
+using namespace boost::asio;
+using namespace boost::asio::ip;
+
+using Clock = std::chrono::steady_clock;
+
+/** The settings for one run of the load generator. */
+struct LoadConfig {
+    // The server to send requests to.
+    std::string host = "localhost", port = "8080";
+    // The canned scenario to run (ignored if requestFile is set).
+    std::string scenario = "small";
+    // File with requests to be replayed.
+    std::string requestFile;
+    // Path (or for cgi, the sleep time) used by the scenario.
+    std::string path;
+    // Number of connections (and threads) sending requests.
+    int connections = 16;
+    // Seconds to run for.
+    double duration = 10;
+    // Requests/sec for all connections together; 0 for closed loop.
+    double rate = 0;
+    // The HTTP status code that counts as success.  If 0 then any 2xx
+    // or 304 status counts as success.
+    int expect = 0;
+    // Size of the file generated for the large scenario.
+    size_t largeBytes = size_t(32) << 20;
+};
+
+/** The results gathered by one connection. */
+struct LoadResult {
+    // Latencies (in microseconds) measured from the actual send time.
+    std::vector<uint32_t> measured;
+    // Latencies measured from the scheduled send time (open loop only).
+    std::vector<uint32_t> scheduled;
+    // Number of responses with each status code.
+    std::map<int, uint64_t> statuses;
+    // Requests that failed due to connection or protocol errors.
+    uint64_t ioErrors = 0;
+    // Responses with an unexpected status code.
+    uint64_t badStatus = 0;
+    // Total bytes received (headers and bodies).
+    uint64_t bytes = 0;
+    // Number of times the connection had to be (re)established.
+    uint64_t connects = 0;
+};
+
+/** Returns the requests for a canned scenario.
+
+    \param[in,out] config The configuration.  The expected status code
+    is set for scenarios that expect errors.
+
+    \param[in] conn The index of the connection, used to make the
+    missing file names different for each connection.
+ */
+std::vector<std::string> scenarioRequests(LoadConfig& config, int conn) {
+    const std::string headers = " HTTP/1.1\r\nHost: " + config.host +
+        "\r\nConnection: keep-alive\r\n\r\n";
+    std::vector<std::string> requests;
+    if (config.scenario == "small") {
+        const std::string path = config.path.empty() ? "mystyle.css" :
+                                 config.path;
+        requests.push_back("GET /" + path + headers);
+    } else if (config.scenario == "large") {
+        requests.push_back("GET /" + config.path + headers);
+    } else if (config.scenario == "404") {
+        config.expect = (config.expect == 0) ? 404 : config.expect;
+        for (int i = 0; (i < 64); i++) {
+            requests.push_back("GET /missing-" + std::to_string(conn) + "-" +
+                               std::to_string(i) + ".html" + headers);
+        }
+    } else if (config.scenario == "cgi") {
+        const std::string secs = config.path.empty() ? "1" : config.path;
+        requests.push_back("GET /cgi-bin/exec?cmd=sleep&args=" + secs +
+                           headers);
+    } else {
+        throw std::runtime_error("Unknown scenario " + config.scenario);
+    }
+    return requests;
+}
+
+/** Create a file of random (incompressible) bytes in a new temporary
+    directory under the current directory.
+
+    \param[in] bytes The size of the file.
+
+    \return The path to the file, relative to the current directory.
+ */
+std::string makeLargeFile(size_t bytes) {
+    char dir[] = "loadgen-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        throw std::runtime_error("Unable to create a temporary directory");
+    }
+    const std::string path = std::string(dir) + "/large.bin";
+    std::ofstream out(path, std::ios::binary);
+    std::mt19937_64 random(bytes);
+    std::vector<uint64_t> block(8192);
+    for (size_t written = 0; (written < bytes);) {
+        for (auto& word : block) {
+            word = random();
+        }
+        const size_t count = std::min(bytes - written, block.size() * 8);
+        out.write(reinterpret_cast<const char*>(block.data()), count);
+        written += count;
+    }
+    if (!out.good()) {
+        throw std::runtime_error("Unable to write " + path);
+    }
+    return path;
+}
+
+/** A file made by makeLargeFile.  The file and its directory are
+    removed when this object goes away.
+ */
+struct LargeFile {
+    std::string path;
+
+    ~LargeFile() {
+        if (!path.empty()) {
+            std::remove(path.c_str());
+            rmdir(path.substr(0, path.find('/')).c_str());
+        }
+    }
+};
+
+/** Load the requests to be replayed from a file.
+
+    \param[in] fileName The file with one or more requests separated
+    by blank lines.
+ */
+std::vector<std::string> loadRequests(const std::string& fileName) {
+    std::ifstream in(fileName);
+    if (!in.good()) {
+        throw std::runtime_error("Unable to read " + fileName);
+    }
+    std::vector<std::string> requests;
+    std::string line, request;
+    while (std::getline(in, line)) {
+        if (!line.empty() && (line.back() == '\r')) {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            request += line + "\r\n";
+        } else if (!request.empty()) {
+            requests.push_back(request + "\r\n");
+            request.clear();
+        }
+    }
+    if (!request.empty()) {
+        requests.push_back(request + "\r\n");
+    }
+    if (requests.empty()) {
+        throw std::runtime_error("No requests in " + fileName);
+    }
+    return requests;
+}
+
+/** Read one HTTP response from the server.
+
+    The body is read (and discarded) based on its Content-Length,
+    chunked transfer encoding, or by reading until the server closes
+    the connection.
+
+    \param[in] sock The connection to the server.
+
+    \param[in,out] buf Data received but not yet used.  Data after the
+    end of this response is left in the buffer.
+
+    \param[out] keepAlive Set to false if the server will close the
+    connection after this response.
+
+    \param[out] bytes The number of bytes in the response.
+
+    \return The status code of the response.
+ */
+int readResponse(tcp::socket& sock, streambuf& buf, bool& keepAlive,
+                 uint64_t& bytes) {
+    size_t len = read_until(sock, buf, "\r\n\r\n");
+    bytes = len;
+    std::string head(buffers_begin(buf.data()),
+                     buffers_begin(buf.data()) + len);
+    buf.consume(len);
+    std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+    const int status = std::stoi(head.substr(head.find(' ') + 1, 3));
+    keepAlive = (head.find("connection: close") == std::string::npos);
+    const size_t clPos = head.find("content-length:");
+    if ((status == 304) || (status / 100 == 1) || (status == 204)) {
+        return status;  // No body.
+    } else if (clPos != std::string::npos) {
+        const size_t length = std::stoul(head.substr(clPos + 15));
+        if (buf.size() < length) {
+            read(sock, buf, transfer_exactly(length - buf.size()));
+        }
+        buf.consume(length);
+        bytes += length;
+    } else if (head.find("transfer-encoding: chunked") != std::string::npos) {
+        while (true) {
+            len = read_until(sock, buf, "\r\n");
+            const std::string size(buffers_begin(buf.data()),
+                                   buffers_begin(buf.data()) + len);
+            buf.consume(len);
+            const size_t chunk = std::stoul(size, nullptr, 16);
+            if (buf.size() < chunk + 2) {
+                read(sock, buf, transfer_exactly(chunk + 2 - buf.size()));
+            }
+            buf.consume(chunk + 2);
+            bytes += len + chunk + 2;
+            if (chunk == 0) {
+                break;  // Assumes that there are no trailers.
+            }
+        }
+    } else {
+        // The body ends when the server closes the connection.
+        boost::system::error_code ec;
+        bytes += buf.size() + read(sock, buf, transfer_all(), ec);
+        buf.consume(buf.size());
+        keepAlive = false;
+    }
+    return status;
+}
+
+/** Returns true if the status code counts as a successful response. */
+bool isExpected(int status, int expect) {
+    return (expect != 0) ? (status == expect) :
+        ((status / 100 == 2) || (status == 304));
+}
+
+/** Send requests on one connection until the end time is reached.
+
+    \param[in] config The settings for the run.
+
+    \param[in] endpoints The addresses of the server (resolved once).
+
+    \param[in] requests The requests to be sent in turn.
+
+    \param[in] start The time at which all connections start.
+
+    \param[in] interval The time between requests on this connection
+    in open-loop mode, or zero for closed loop.
+
+    \param[out] result The measurements made by this connection.
+ */
+void runConnection(const LoadConfig& config,
+                   const tcp::resolver::results_type& endpoints,
+                   const std::vector<std::string>& requests,
+                   Clock::time_point start, Clock::duration interval,
+                   LoadResult& result) {
+    const Clock::time_point end = start +
+        std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(config.duration));
+    io_service service;
+    tcp::socket sock(service);
+    streambuf buf;
+    bool connected = false;
+    size_t next = 0;
+    std::this_thread::sleep_until(start);
+    for (uint64_t i = 0; ; i++) {
+        // In open-loop mode wait for the scheduled time to send.
+        const Clock::time_point due = start + interval * i;
+        if (due >= end) {
+            break;
+        }
+        std::this_thread::sleep_until(due);
+        const Clock::time_point sent = Clock::now();
+        if (sent >= end) {
+            break;
+        }
+        try {
+            if (!connected) {
+                sock = tcp::socket(service);
+                connect(sock, endpoints);
+                sock.set_option(tcp::no_delay(true));
+                buf.consume(buf.size());
+                connected = true;
+                result.connects++;
+            }
+            write(sock, buffer(requests[next++ % requests.size()]));
+            bool keepAlive = true;
+            uint64_t bytes = 0;
+            const int status = readResponse(sock, buf, keepAlive, bytes);
+            const Clock::time_point done = Clock::now();
+            using std::chrono::duration_cast;
+            using std::chrono::microseconds;
+            result.measured.push_back(duration_cast<microseconds>(
+                                          done - sent).count());
+            if (interval != Clock::duration::zero()) {
+                result.scheduled.push_back(duration_cast<microseconds>(
+                                               done - due).count());
+            }
+            result.statuses[status]++;
+            result.bytes += bytes;
+            if (!isExpected(status, config.expect)) {
+                result.badStatus++;
+            }
+            connected = keepAlive;
+        } catch (const std::exception&) {
+            result.ioErrors++;
+            connected = false;
+            boost::system::error_code ignored;
+            sock.close(ignored);
+        }
+    }
+}
+
+/** Returns the value at the given percentile of sorted values. */
+double percentile(const std::vector<uint32_t>& sorted, double pct) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    const size_t rank = std::ceil(pct / 100 * sorted.size());
+    return sorted[std::min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+/** Add the samples that would have been measured had requests been
+    sent at the expected interval (coordinated omission correction).
+
+    \param[in] measured The latencies measured in closed-loop mode.
+
+    \param[in] expected The expected interval between requests.
+
+    \return The measured latencies along with the back-filled ones.
+ */
+std::vector<uint32_t> correctLatencies(const std::vector<uint32_t>& measured,
+                                       uint32_t expected) {
+    std::vector<uint32_t> corrected = measured;
+    if (expected == 0) {
+        return corrected;
+    }
+    for (const uint32_t latency : measured) {
+        for (uint64_t missing = latency; missing > expected; ) {
+            missing -= expected;
+            corrected.push_back(missing);
+        }
+    }
+    return corrected;
+}
+
+/** Print one row of the latency table (values in milliseconds). */
+void printLatencies(const std::string& label, std::vector<uint32_t> values) {
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (const uint32_t v : values) {
+        sum += v;
+    }
+    std::cout << std::left << std::setw(12) << label << std::right
+              << std::fixed << std::setprecision(3);
+    for (const double pct : {50.0, 90.0, 99.0, 99.9}) {
+        std::cout << std::setw(10) << percentile(values, pct) / 1000;
+    }
+    std::cout << std::setw(10) << (values.empty() ? 0 : values.back() / 1000.0)
+              << std::setw(10) << (values.empty() ? 0 : sum / values.size()
+                                   / 1000) << '\n';
+}
+
+/** Print the summary of a run from the results of all connections. */
+void printReport(const LoadConfig& config,
+                 const std::vector<LoadResult>& results) {
+    LoadResult total;
+    for (const LoadResult& r : results) {
+        total.measured.insert(total.measured.end(), r.measured.begin(),
+                              r.measured.end());
+        total.scheduled.insert(total.scheduled.end(), r.scheduled.begin(),
+                               r.scheduled.end());
+        for (const auto& s : r.statuses) {
+            total.statuses[s.first] += s.second;
+        }
+        total.ioErrors  += r.ioErrors;
+        total.badStatus += r.badStatus;
+        total.bytes     += r.bytes;
+        total.connects  += r.connects;
+    }
+    const uint64_t requests = total.measured.size() + total.ioErrors;
+    const uint64_t errors   = total.ioErrors + total.badStatus;
+    std::cout << std::fixed << std::setprecision(1)
+              << "Scenario:    " << (config.requestFile.empty() ?
+                                     config.scenario : config.requestFile)
+              << " (" << (config.rate > 0 ? "open" : "closed") << " loop, "
+              << config.connections << " connections, " << config.duration
+              << " s)\n"
+              << "Requests:    " << requests << " ("
+              << total.measured.size() / config.duration << " responses/s, "
+              << total.bytes / config.duration / (1 << 20) << " MB/s)\n"
+              << "Connects:    " << total.connects << '\n'
+              << "Errors:      " << errors << " (" << std::setprecision(2)
+              << (requests ? 100.0 * errors / requests : 0.0) << "%; "
+              << total.ioErrors << " I/O, " << total.badStatus
+              << " unexpected status)\n"
+              << "Status:     ";
+    for (const auto& s : total.statuses) {
+        std::cout << ' ' << s.first << '=' << s.second;
+    }
+    std::cout << "\n\nLatency (ms)       p50       p90       p99     p99.9"
+              << "       max      mean\n";
+    printLatencies("measured", total.measured);
+    if (config.rate > 0) {
+        printLatencies("corrected", total.scheduled);
+    } else {
+        std::vector<uint32_t> sorted = total.measured;
+        std::sort(sorted.begin(), sorted.end());
+        printLatencies("corrected", correctLatencies(total.measured,
+                                                     percentile(sorted, 50)));
+    }
+}
+
+/** Set up the load configuration from command-line arguments.
+
+    \param[in] argc The number of command-line arguments.
+    \param[in] argv The command-line arguments: host, port, and then
+    options of the form "--name=value".
+ */
+LoadConfig parseArgs(int argc, char *argv[]) {
+    LoadConfig config;
+    config.host = argv[1];
+    config.port = argv[2];
+    for (int i = 3; (i < argc); i++) {
+        const std::string arg = argv[i];
+        const size_t eq       = arg.find('=');
+        const std::string opt = arg.substr(0, eq);
+        const std::string val = (eq == std::string::npos) ? "" :
+                                arg.substr(eq + 1);
+        if (opt == "--scenario") {
+            config.scenario = val;
+        } else if (opt == "--file") {
+            config.requestFile = val;
+        } else if (opt == "--path") {
+            config.path = val;
+        } else if (opt == "--connections") {
+            config.connections = std::max(1, std::stoi(val));
+        } else if (opt == "--duration") {
+            config.duration = std::max(0.1, std::stod(val));
+        } else if (opt == "--rate") {
+            config.rate = std::stod(val);
+        } else if (opt == "--expect") {
+            config.expect = std::stoi(val);
+        } else if (opt == "--large-mb") {
+            config.largeBytes = std::max(1ul, std::stoul(val)) << 20;
+        } else {
+            std::cerr << "Ignoring unknown option " << opt << std::endl;
+        }
+    }
+    return config;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> [--scenario="
+                  << "small|large|404|cgi] [--file=requests.txt]\n"
+                  << "       [--connections=16] [--duration=10] [--rate=0]"
+                  << " [--path=...] [--expect=200]\n";
+        return 1;
+    }
+    LoadConfig config = parseArgs(argc, argv);
+    // Set up the requests to be sent on each connection.
+    std::vector<std::vector<std::string>> requests;
+    LargeFile largeFile;
+    try {
+        if (config.requestFile.empty() && (config.scenario == "large") &&
+            config.path.empty()) {
+            largeFile.path = makeLargeFile(config.largeBytes);
+            config.path    = largeFile.path;
+        }
+        for (int i = 0; (i < config.connections); i++) {
+            requests.push_back(config.requestFile.empty() ?
+                               scenarioRequests(config, i) :
+                               loadRequests(config.requestFile));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    // Resolve the server's address just once for all connections.
+    io_service service;
+    tcp::resolver resolver(service);
+    tcp::resolver::results_type endpoints;
+    try {
+        endpoints = resolver.resolve(config.host, config.port);
+    } catch (const std::exception& e) {
+        std::cerr << "Unable to resolve " << config.host << ":"
+                  << config.port << ": " << e.what() << std::endl;
+        return 1;
+    }
+    // In open-loop mode the rate is divided evenly among connections.
+    Clock::duration interval = Clock::duration::zero();
+    if (config.rate > 0) {
+        interval = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(config.connections / config.rate));
+    }
+    std::vector<LoadResult> results(config.connections);
+    std::vector<std::thread> threads;
+    const Clock::time_point start = Clock::now() +
+        std::chrono::milliseconds(100);
+    for (int i = 0; (i < config.connections); i++) {
+        // Stagger open-loop connections so that sends are spread out.
+        const Clock::time_point connStart = start + interval * i /
+            config.connections;
+        threads.emplace_back(runConnection, std::cref(config),
+                             std::cref(endpoints), std::cref(requests[i]),
+                             connStart, interval, std::ref(results[i]));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    printReport(config, results);
+    return 0;
+}
@@ -59,12 +59,12 @@ LDLIBSOPTIONS=
 	"${MAKE}"  -f nbproject/Makefile-${CND_CONF}.mk bowserbl_HW7_opt
 
 bowserbl_HW7_opt: ${OBJECTFILES}
-	${LINK.cc} -o bowserbl_HW7_opt ${OBJECTFILES} ${LDLIBSOPTIONS} -lboost_system -lpthread -lmysqlpp
+	${LINK.cc} -o bowserbl_HW7_opt ${OBJECTFILES} ${LDLIBSOPTIONS} -lboost_system -lpthread -lmysqlpp -lz
 
 ${OBJECTDIR}/bowserbl_HW7.o: bowserbl_HW7.cpp
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
-	$(COMPILE.cc) -O2 -Wall -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/bowserbl_HW7.o bowserbl_HW7.cpp
+	$(COMPILE.cc) -O2 -Wall -std=c++17 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/bowserbl_HW7.o bowserbl_HW7.cpp
 
 # Subprojects
 .build-subprojects: